@@ -1,7 +1,11 @@
 #include "BF.h"
 #include "Kmers.h"
 #include "util.h"
+#include "Sketch.h"
 
+#include <array>
+#include <cstdio>
+#include <thread>
 #include <jellyfish/file_header.hpp>
 
 BF::BF(const std::string & f, HashPair hp, int nh) :
@@ -19,13 +23,13 @@ BF::~BF() {
 }
 
 void BF::add(const jellyfish::mer_dna & m) {
-    jellyfish::mer_dna can(m);
-    can.canonicalize();
-    uint64_t h0 = hashes.m1.times(can);
-    uint64_t h1 = hashes.m2.times(can);
-    
-    const size_t base = h0 % size();
-    const size_t inc = h1 % size();
+    add(hash_kmer(hashes, m));
+}
+
+// add the kmer with the given hashes
+void BF::add(const KmerHash & h) {
+    const size_t base = h.first % size();
+    const size_t inc = h.second % size();
 
     for (unsigned long i = 0; i < num_hash; ++i) {
         const size_t pos = (base + i * inc) % size();
@@ -33,26 +37,43 @@ void BF::add(const jellyfish::mer_dna & m) {
     }
 }
 
+// add() that is safe to call from several threads at once
+void BF::add_concurrent(const KmerHash & h) {
+    const size_t base = h.first % size();
+    const size_t inc = h.second % size();
+
+    for (unsigned long i = 0; i < num_hash; ++i) {
+        const size_t pos = (base + i * inc) % size();
+        this->set_bit_concurrent(pos);
+    }
+}
+
 // set the bit at position 1 (can't use operator[] b/c we'd need
 // to return a proxy, which is more trouble than its worth)
 void BF::set_bit(uint64_t p) {
     DIE("Compressed BF are not mutable!");
 }
 
+void BF::set_bit_concurrent(uint64_t p) {
+    DIE("Compressed BF are not mutable!");
+}
+
+// hash the canonical form of the kmer
+KmerHash hash_kmer(const HashPair & hp, const jellyfish::mer_dna & m) {
+    jellyfish::mer_dna n(m);
+    n.canonicalize();
+    return KmerHash(hp.m1.times(n), hp.m2.times(n));
+}
+
 // returns true iff the bloom filter contains the given kmer
 bool BF::contains(const jellyfish::mer_dna & m) const {
-    //std::cout << "TESTING STUFF: " << m.to_str() << std::endl;
-    std::string temp = m.to_str();
-    jellyfish::mer_dna n = jellyfish::mer_dna(temp);
-    n.canonicalize();
-    //std::cout << "Canonical version! " << n.to_str() << std::endl;
-    uint64_t h0 = hashes.m1.times(n);
-    uint64_t h1 = hashes.m2.times(n);
+    return contains(hash_kmer(hashes, m));
+}
 
-    //DEBUG: std::cout << "size = " << bits->size() << std::endl;
-    
-    const size_t base = h0 % size();
-    const size_t inc = h1 % size();
+// returns true iff the bloom filter contains the kmer with the given hashes
+bool BF::contains(const KmerHash & h) const {
+    const size_t base = h.first % size();
+    const size_t inc = h.second % size();
 
     for (unsigned long i = 0; i < num_hash; ++i) {
         const size_t pos = (base + i * inc) % size();
@@ -80,16 +101,45 @@ int BF::operator[](uint64_t pos) const {
 }
 
 
+// size of the stream buffer used when reading filters: large enough that a
+// filter is read with a few big sequential reads rather than many small ones
+static const std::size_t LOAD_BUFFER_SIZE = 8 << 20;
+
+// like sdsl::load_from_file, but reading through a large buffer
+template <typename V>
+static void load_vector(V & v, const std::string & filename) {
+    std::vector<char> buf(LOAD_BUFFER_SIZE);
+    std::ifstream in;
+    in.rdbuf()->pubsetbuf(buf.data(), buf.size());
+    in.open(filename, std::ios::in | std::ios::binary);
+    DIE_IF(!in.good(), "Couldn't open bloom filter " + filename);
+    v.load(in);
+}
+
+// write v to filename by way of a temporary file, so that a crash never
+// leaves a partly written filter behind
+template <typename V>
+static void store_atomically(const V & v, const std::string & filename) {
+    std::string tmp = filename + ".tmp";
+    DIE_IF(!sdsl::store_to_file(v, tmp), "Couldn't write " + tmp);
+    DIE_IF(rename(tmp.c_str(), filename.c_str()) != 0, "Couldn't rename " + tmp + " to " + filename);
+}
+
 // read the bit vector and the matrices for the hash functions.
 void BF::load() {
     // read the actual bits
     bits = new sdsl::rrr_vector<255>();
-    sdsl::load_from_file(*bits, filename);
+    load_vector(*bits, filename);
 }
 
 void BF::save() {
     std::cerr << "Saving BF to " << filename << std::endl;
-    sdsl::store_to_file(*bits, filename);
+    store_atomically(*bits, filename);
+}
+
+// save to new_name from now on; the old file is left as it is
+void BF::rename(const std::string & new_name) {
+    filename = new_name;
 }
 
 
@@ -135,9 +185,28 @@ void BF::union_into(const BF* other) {
     DIE("not yet implemented");
 }
 
+// OR f2 into this filter and compute the similarity of f2 to c0 and c1
+// (sims[0] and sims[1]), as similarity(f2, type) would
+void BF::union_into_and_compare(const BF* f2, const BF* c0, const BF* c1,
+    int type, uint64_t sims[2], unsigned nb_threads
+) {
+    sims[0] = c0->similarity(f2, type);
+    sims[1] = c1->similarity(f2, type);
+    union_into(f2);
+}
+
 uint64_t BF::count_ones() const {
-    DIE("not yet implemented");
-    return 0;
+    sdsl::rrr_vector<255>::rank_1_type rank(bits);
+    return rank(bits->size());
+}
+
+// add the position of every set bit to the sketch
+void BF::sketch_into(Sketch & s) const {
+    sdsl::rrr_vector<255>::select_1_type select(bits);
+    uint64_t ones = count_ones();
+    for (uint64_t i = 1; i <= ones; i++) {
+        s.add(select(i));
+    }
 }
 
 void BF::compress() {
@@ -175,24 +244,13 @@ void UncompressedBF::load() {
     }
 
 
-    sdsl::load_from_file(*bv, filename);
+    load_vector(*bv, filename);
     std::cerr << "Loaded bv size " << bv->size() << ' ' << size() << std::endl;
 }
 
 void UncompressedBF::save() {
     std::cerr << "Saving BF to " << filename << std::endl;
-    sdsl::store_to_file(*bv, filename);
-    struct stat buf;
-    if (stat(filename.c_str(), &buf) == -1){
-        std::cerr << "Cant stat " << filename  << std::endl;
-    } else {
-        std::cerr << buf.st_size << ' ' << bv->size() << std::endl;
-    }
-    std::ifstream is(filename);
-    size_t s;
-    is.read((char*)&s, sizeof(s));
-    std::cerr << "save header " << s << std::endl;
-    assert(s == size());
+    store_atomically(*bv, filename);
 }
 
 
@@ -208,6 +266,12 @@ void UncompressedBF::set_bit(uint64_t p) {
     (*bv)[p] = 1;
 }
 
+// set the bit with an atomic OR on its word, so threads setting other bits
+// of the same word don't lose each other's writes
+void UncompressedBF::set_bit_concurrent(uint64_t p) {
+    __atomic_fetch_or(bv->data() + (p >> 6), uint64_t(1) << (p & 63), __ATOMIC_RELAXED);
+}
+
 BF* UncompressedBF::union_with(const std::string & new_name, const BF* f2) const {
     std::cerr << "Union with " << f2->size() << " " << size() << std::endl;
     assert(size() == f2->size());
@@ -239,6 +303,78 @@ void UncompressedBF::union_into(const BF* f2) {
     }
 }
 
+// the popcounts behind similarity(), for one child
+struct SimilarityCounts {
+    uint64_t xor_count;
+    uint64_t or_count;
+};
+
+// does union_into(f2) and both child similarities in a single pass over the
+// four filters, with the words split among nb_threads threads
+void UncompressedBF::union_into_and_compare(const BF* f2, const BF* c0, const BF* c1,
+    int type, uint64_t sims[2], unsigned nb_threads
+) {
+    assert(size() == f2->size());
+    assert(size() == c0->size() && size() == c1->size());
+    if (type != 0 && type != 1) {
+        DIE("ERROR: ONLY TWO TYPES IMPLEMENTED");
+    }
+
+    const UncompressedBF* n = dynamic_cast<const UncompressedBF*>(f2);
+    const UncompressedBF* a = dynamic_cast<const UncompressedBF*>(c0);
+    const UncompressedBF* b = dynamic_cast<const UncompressedBF*>(c1);
+    if (n == nullptr || a == nullptr || b == nullptr) {
+        DIE("Can only union and compare uncompressed BF");
+    }
+
+    uint64_t* t_data = this->bv->data();
+    const uint64_t* n_data = n->bv->data();
+    const uint64_t* a_data = a->bv->data();
+    const uint64_t* b_data = b->bv->data();
+
+    sdsl::bit_vector::size_type len = size()>>6;
+    nb_threads = std::max(1u, std::min<unsigned>(nb_threads, len / 4096 + 1));
+    std::vector<std::array<SimilarityCounts, 2> > counts(nb_threads);
+
+    auto work = [&](unsigned i) {
+        sdsl::bit_vector::size_type lo = len * i / nb_threads;
+        sdsl::bit_vector::size_type hi = len * (i + 1) / nb_threads;
+        SimilarityCounts ca = {0, 0}, cb = {0, 0};
+        for (sdsl::bit_vector::size_type p = lo; p < hi; ++p) {
+            uint64_t w = n_data[p];
+            ca.xor_count += __builtin_popcountl(a_data[p] ^ w);
+            ca.or_count += __builtin_popcountl(a_data[p] | w);
+            cb.xor_count += __builtin_popcountl(b_data[p] ^ w);
+            cb.or_count += __builtin_popcountl(b_data[p] | w);
+            t_data[p] |= w;
+        }
+        counts[i][0] = ca;
+        counts[i][1] = cb;
+    };
+
+    std::vector<std::thread> threads;
+    for (unsigned i = 1; i < nb_threads; i++) {
+        threads.emplace_back(work, i);
+    }
+    work(0);
+    for (auto & th : threads) {
+        th.join();
+    }
+
+    for (int c = 0; c < 2; c++) {
+        SimilarityCounts total = {0, 0};
+        for (const auto & part : counts) {
+            total.xor_count += part[c].xor_count;
+            total.or_count += part[c].or_count;
+        }
+        if (type == 1) {
+            sims[c] = uint64_t(float(total.or_count - total.xor_count) / float(total.or_count) * size());
+        } else {
+            sims[c] = size() - total.xor_count;
+        }
+    }
+}
+
 uint64_t UncompressedBF::similarity(const BF* other, int type) const {
     assert(other->size() == size());
 
@@ -317,21 +453,27 @@ int popcount(uint64_t b) {
 
 // return the # of 1s in the bitvector
 uint64_t UncompressedBF::count_ones() const {
-    uint64_t* data = bv->data();
+    const uint64_t* data = bv->data();
     sdsl::bit_vector::size_type len = bv->size()>>6;
     uint64_t count = 0;
     for (sdsl::bit_vector::size_type p = 0; p < len; ++p) {
-        int pc = popcount(*data);
-        DIE_IF(pc != __builtin_popcountl(*data), "popcountl and us disagree about popcount");
-        data++;
-        count += pc;
+        count += __builtin_popcountl(*data++);
     }
-
-    sdsl::rank_support_v<> rbv(bv);
-    DIE_IF(rbv.rank(bv->size()) != count, "SDSL and us disagree about number of 1s");
     return count;
 }
 
+void UncompressedBF::sketch_into(Sketch & s) const {
+    const uint64_t* data = bv->data();
+    sdsl::bit_vector::size_type len = (size() + 63)>>6;
+    for (sdsl::bit_vector::size_type p = 0; p < len; ++p) {
+        uint64_t w = data[p];
+        while (w != 0) {
+            s.add((p << 6) + __builtin_ctzl(w));
+            w &= w - 1;
+        }
+    }
+}
+
 void UncompressedBF::compress() {
 	sdsl::rrr_vector<255> rrr(*bv);
 	std::cerr << "Compressed RRR vector is " << sdsl::size_in_mega_bytes(rrr) << std::endl;
@@ -365,3 +507,13 @@ BF* load_bf_from_file(const std::string & fn, HashPair hp, int nh) {
     }
 }
 
+
+// write the RRR compressed copy of an uncompressed filter file to fn.rrr,
+// without going through a BF (so it is safe to call from several threads)
+void compress_filter_file(const std::string & fn) {
+    sdsl::bit_vector b;
+    load_vector(b, fn);
+    sdsl::rrr_vector<255> rrr(b);
+    std::cerr << "Compressed " << fn << " to " << sdsl::size_in_mega_bytes(rrr) << " MB" << std::endl;
+    store_atomically(rrr, fn + ".rrr");
+}
@@ -7,8 +7,16 @@
 #include <jellyfish/mer_dna_bloom_counter.hpp>
 #include "Kmers.h"
 
+class Sketch;
+
 using HashPair = jellyfish::hash_pair<jellyfish::mer_dna>;
 
+// the two base hash values from which a kmer's bit positions are derived.
+// They depend only on the kmer and the HashPair, so they can be computed once
+// per kmer and reused for every filter sharing the HashPair.
+using KmerHash = std::pair<uint64_t, uint64_t>;
+KmerHash hash_kmer(const HashPair & hp, const jellyfish::mer_dna & m);
+
 // a kmer bloom filter
 class BF {
 public:
@@ -17,21 +25,29 @@ public:
 
     virtual void load();
     virtual void save();
+    void rename(const std::string & new_name);
 
     virtual int operator[](uint64_t pos) const;
     virtual void set_bit(uint64_t p);
+    virtual void set_bit_concurrent(uint64_t p);
     virtual uint64_t size() const;
 
     virtual bool contains(const jellyfish::mer_dna & m) const;
     bool contains(const std::string & str) const;
+    bool contains(const KmerHash & h) const;
 
     void add(const jellyfish::mer_dna & m);
+    void add(const KmerHash & h);
+    void add_concurrent(const KmerHash & h);
 
     virtual uint64_t similarity(const BF* other, int type) const;
     virtual std::tuple<uint64_t, uint64_t> b_similarity(const BF* other) const;
     virtual BF* union_with(const std::string & new_name, const BF* f2) const;
     virtual void union_into(const BF* f2);
+    virtual void union_into_and_compare(const BF* f2, const BF* c0, const BF* c1,
+        int type, uint64_t sims[2], unsigned nb_threads);
     virtual uint64_t count_ones() const;
+    virtual void sketch_into(Sketch & s) const;
     virtual void compress();
 protected:
     std::string filename;
@@ -52,12 +68,16 @@ public:
 
     virtual int operator[](uint64_t pos) const;
     virtual void set_bit(uint64_t p);
+    virtual void set_bit_concurrent(uint64_t p);
     virtual uint64_t size() const;
     virtual uint64_t similarity(const BF* other, int type) const;
     virtual std::tuple<uint64_t, uint64_t> b_similarity(const BF* other) const;
     virtual BF* union_with(const std::string & new_name, const BF* f2) const;
     virtual void union_into(const BF* f2);
+    virtual void union_into_and_compare(const BF* f2, const BF* c0, const BF* c1,
+        int type, uint64_t sims[2], unsigned nb_threads);
     virtual uint64_t count_ones() const;
+    virtual void sketch_into(Sketch & s) const;
     virtual void compress();
 protected:
     sdsl::bit_vector* bv;
@@ -65,5 +85,6 @@ protected:
 
 sdsl::bit_vector* union_bv_fast(const sdsl::bit_vector & b1, const sdsl::bit_vector& b2);
 BF* load_bf_from_file(const std::string & fn, HashPair hp, int nh);
+void compress_filter_file(const std::string & fn);
 
 #endif
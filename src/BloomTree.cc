@@ -2,14 +2,25 @@
 #include "util.h"
 #include "BF.h"
 #include "gzstream.h"
+#include "Trace.h"
+#include "PerfCounters.h"
+#include "WriteBehind.h"
 
+#include <cstdio>
 #include <fstream>
 #include <list>
+#include <atomic>
 #include <cassert>
 #include <jellyfish/file_header.hpp>
 
 Heap<const BloomTree> BloomTree::bf_cache;
 int BF_INMEM_LIMIT = 100;
+bool CACHE_COUNTERS_ENABLED = false;
+
+// atomic since leaf scans load filters from several threads
+static std::atomic<uint64_t> cache_hit_count(0);
+static std::atomic<uint64_t> cache_miss_count(0);
+static std::atomic<uint64_t> cache_bytes_loaded(0);
 
 // construct a bloom filter with the given filter backing.
 BloomTree::BloomTree(
@@ -24,15 +35,23 @@ BloomTree::BloomTree(
     heap_ref(nullptr),
     parent(0),
     usage_count(0),
-    dirty(false)
+    dirty(false),
+    node_sketch(nullptr),
+    sketch_dirty(false)
 {
     children[0] = nullptr;
     children[1] = nullptr;
 }
 
-// free the memory for this node.
+// free the memory for this node, first taking it out of the cache so the
+// cache never holds a deleted node
 BloomTree::~BloomTree() {
+    if (heap_ref != nullptr) {
+        bf_cache.remove(heap_ref);
+        heap_ref = nullptr;
+    }
     unload();
+    delete node_sketch;
 }
 
 std::string BloomTree::name() const {
@@ -60,16 +79,56 @@ const BloomTree* BloomTree::get_parent() const {
     return this->parent;
 }
 
+// number of ancestors of this node (0 for the root)
+int BloomTree::depth() const {
+    int d = 0;
+    for (const BloomTree* p = parent; p != nullptr; p = p->parent) d++;
+    return d;
+}
+
 void BloomTree::set_parent(const BloomTree* p) {
     parent = const_cast<BloomTree*>(p);
 }
 
 // return the bloom filter, loading first if necessary
 BF* BloomTree::bf() const {
+    if (bloom_filter != nullptr && CACHE_COUNTERS_ENABLED) {
+        cache_hit_count.fetch_add(1, std::memory_order_relaxed);
+    }
     load();
     return bloom_filter;
 }
 
+// true if the bloom filter is currently in memory
+bool BloomTree::is_loaded() const {
+    return bloom_filter != nullptr;
+}
+
+// read this node's filter into a new BF that is not tracked by the cache;
+// the caller owns it. Safe to call from several threads at once.
+BF* BloomTree::load_detached() const {
+    PerfScope perf(PERF_LOAD, this);
+    flush_writes();
+    TraceClock::time_point start;
+    if (TRACE_ENABLED) start = TraceClock::now();
+    BF* f = load_bf_from_file(filename, hashes, num_hash);
+    f->load();
+
+    uint64_t bytes = file_size(filename);
+    cache_miss_count++;
+    cache_bytes_loaded += bytes;
+    if (TRACE_ENABLED) trace_load(filename, bytes, seconds_since(start));
+    return f;
+}
+
+int BloomTree::num_hashes() const {
+    return num_hash;
+}
+
+const HashPair & BloomTree::hash_pair() const {
+    return hashes;
+}
+
 // return the number of times this bloom filter has been used.
 int BloomTree::usage() const {
     return usage_count;
@@ -90,17 +149,39 @@ void BloomTree::unload() const {
     // you can't unload something until you remove it from the cache
     // DEBUG std::cerr << "Unloading " << name() << std::endl;
     
-    // free the memory
-    if (bloom_filter != nullptr) {
-        if (dirty) {
-            bloom_filter->save();
-        }
+    // the sketch stays in memory, but its file should match the filter's. It
+    // is saved after the filter, or it would look out of date (see sketch())
+    std::function<void()> save_sketch;
+    if (sketch_dirty) {
+        Sketch s = *node_sketch;
+        std::string fn = sketch_file(filename);
+        save_sketch = [s, fn]() { s.save(fn); };
+        sketch_dirty = false;
+    }
+
+    // free the memory; a changed filter is handed to the background writer
+    if (bloom_filter != nullptr && dirty) {
+        write_behind(filename, bloom_filter, save_sketch);
+    } else {
+        if (save_sketch) save_sketch();
         delete bloom_filter; 
-        bloom_filter = nullptr; 
     }
+    bloom_filter = nullptr; 
     dirty = false;
 }
 
+// save the filter and sketch if they have changed, but keep them in memory
+void BloomTree::flush() const {
+    if (bloom_filter != nullptr && dirty) {
+        bloom_filter->save();
+        dirty = false;
+    }
+    if (sketch_dirty) {
+        node_sketch->save(sketch_file(filename));
+        sketch_dirty = false;
+    }
+}
+
 void BloomTree::drain_cache() {
     // if the cache is too big
     while (bf_cache.size() >= BF_INMEM_LIMIT && !bf_cache.is_protected()) {
@@ -114,6 +195,20 @@ void BloomTree::drain_cache() {
     }
 }
 
+// unload every filter in the cache, saving those that are dirty
+void BloomTree::clear_cache() {
+    while (bf_cache.size() > 0) {
+        const BloomTree* loser = bf_cache.pop();
+        loser->heap_ref = nullptr;
+        loser->unload();
+    }
+    flush_writes();
+}
+
+CacheCounters BloomTree::cache_counters() {
+    return CacheCounters{cache_hit_count, cache_miss_count, cache_bytes_loaded};
+}
+
 void BloomTree::protected_cache(bool b) {
     bf_cache.set_protected(b);
     if (!b) {
@@ -131,9 +226,28 @@ bool BloomTree::load() const {
         // protected, we're allowed to go over the cache limit)
         if(!bf_cache.is_protected()) BloomTree::drain_cache();
 
+        // a recently evicted filter may not have been written yet
+        bloom_filter = reclaim_write(filename);
+        if (bloom_filter != nullptr) {
+            heap_ref = bf_cache.insert(this, usage());
+            dirty = true;
+            // its sketch, if it was waiting too, was dropped with it
+            if (node_sketch != nullptr) sketch_dirty = true;
+            increment_usage();
+            return true;
+        }
+
         // read the BF file and set bloom_filter
+        PerfScope perf(PERF_LOAD, this);
+        TraceClock::time_point start;
+        if (TRACE_ENABLED) start = TraceClock::now();
         bloom_filter = load_bf_from_file(filename, hashes, num_hash);
         bloom_filter->load();
+
+        uint64_t bytes = file_size(filename);
+        cache_miss_count++;
+        cache_bytes_loaded += bytes;
+        if (TRACE_ENABLED) trace_load(filename, bytes, seconds_since(start));
         heap_ref = bf_cache.insert(this, usage());
         dirty = false;
 
@@ -146,12 +260,58 @@ bool BloomTree::load() const {
 
 
 uint64_t BloomTree::similarity(BloomTree* other, int type) const {
+    PerfScope perf(PERF_SIMILARITY, this);
     protected_cache(true);
     uint64_t sim = this->bf()->similarity(other->bf(), type);
     protected_cache(false);
     return sim;
 }
 
+// the sketch of this node's filter, read from its sidecar file or, if there
+// isn't one or the filter has been written since, computed from the filter
+// (and saved with it)
+const Sketch & BloomTree::sketch() const {
+    if (node_sketch == nullptr) {
+        node_sketch = new Sketch();
+        if (!sketch_current(filename) || !node_sketch->load(sketch_file(filename))) {
+            const BF* f = bf();
+            *node_sketch = Sketch(SKETCH_SIZE, f->size());
+            f->sketch_into(*node_sketch);
+            sketch_dirty = true;
+        }
+    }
+    return *node_sketch;
+}
+
+// replace the sketch, e.g. ahead of a change to the filter it describes
+void BloomTree::set_sketch(const Sketch & s) {
+    if (node_sketch == nullptr) {
+        node_sketch = new Sketch(s);
+    } else {
+        *node_sketch = s;
+    }
+    sketch_dirty = true;
+}
+
+// estimate of similarity() that only needs the two sketches
+uint64_t BloomTree::sketch_similarity(const BloomTree* other, int type) const {
+    PerfScope perf(PERF_SIMILARITY, this);
+    return sketch().similarity(other->sketch(), type);
+}
+
+// after other has been unioned into this node, merge its sketch into ours.
+// A node with no sketch is skipped unless sketches are in use, but an
+// existing sidecar is never left stale.
+void BloomTree::update_sketch(const BloomTree* other) {
+    if (node_sketch == nullptr && !SKETCH_ENABLED
+        && file_size(sketch_file(filename)) == 0) {
+        return;
+    }
+    sketch();
+    node_sketch->merge(other->sketch());
+    sketch_dirty = true;
+}
+
 std::tuple<uint64_t,uint64_t> BloomTree::b_similarity(BloomTree* other) const{
     protected_cache(true);
 std::cerr << "Before \n";
@@ -168,11 +328,17 @@ BloomTree* BloomTree::union_bloom_filters(const std::string & new_name, BloomTre
     // move the union op into BloomTree?
     BloomTree* bt = new BloomTree(new_name, hashes, num_hash);
 
+    PerfScope perf(PERF_UNION, this);
     protected_cache(true);
     bt->bloom_filter = bf()->union_with(new_name, f2->bf()); 
 
     bt->set_child(0, this);
     bt->set_child(1, f2);
+    if (SKETCH_ENABLED || node_sketch != nullptr) {
+        bt->node_sketch = new Sketch(sketch());
+        bt->node_sketch->merge(f2->sketch());
+        bt->sketch_dirty = true;
+    }
     //bf_cache.insert(bt, bt->usage());
     bt->dirty = true;
     bt->unload();
@@ -182,9 +348,83 @@ BloomTree* BloomTree::union_bloom_filters(const std::string & new_name, BloomTre
 }
 
 void BloomTree::union_into(const BloomTree* other) {
+    PerfScope perf(PERF_UNION, this);
     protected_cache(true);
     bf()->union_into(other->bf());
     dirty = true;
+    update_sketch(other);
+    protected_cache(false);
+}
+
+// move this node to a new filter file: its filter (read from the old file if
+// needed) and sketch will be saved under new_name, and the old files are
+// left as they were, so any other tree using them stays valid
+void BloomTree::rename(const std::string & new_name) {
+    if (new_name == filename) return;
+    if (node_sketch == nullptr && file_size(sketch_file(filename)) != 0) sketch();
+    bf()->rename(new_name);
+    filename = new_name;
+    dirty = true;
+    if (node_sketch != nullptr) sketch_dirty = true;
+}
+
+// rebuild this node's filter from its children (after one of them has been
+// replaced or removed) and mark it to be saved
+void BloomTree::recompute_union(const std::string & new_name) {
+    assert(num_children() > 0);
+
+    // move to the new file, leaving the old one (and its sketch) untouched;
+    // the filter in memory is about to be replaced anyway
+    if (!new_name.empty() && new_name != filename) {
+        if (heap_ref != nullptr) {
+            bf_cache.remove(heap_ref);
+            heap_ref = nullptr;
+        }
+        delete bloom_filter;
+        bloom_filter = nullptr;
+        dirty = false;
+        sketch_dirty = false;
+        filename = new_name;
+    }
+    const BloomTree* c0 = (children[0] != nullptr) ? children[0] : children[1];
+    const BloomTree* c1 = (children[1] != nullptr) ? children[1] : children[0];
+
+    // an evicted copy still waiting to be written is out of date
+    if (bloom_filter == nullptr) delete reclaim_write(filename);
+
+    PerfScope perf(PERF_UNION, this);
+    protected_cache(true);
+    BF* u = c0->bf()->union_with(filename, c1->bf());
+    if (bloom_filter != nullptr) {
+        delete bloom_filter;
+        bloom_filter = u;
+    } else {
+        bloom_filter = u;
+        heap_ref = bf_cache.insert(this, usage());
+        increment_usage();
+    }
+    dirty = true;
+
+    if (SKETCH_ENABLED || node_sketch != nullptr || file_size(sketch_file(filename)) != 0) {
+        Sketch* s = new Sketch(c0->sketch());
+        s->merge(c1->sketch());
+        delete node_sketch;
+        node_sketch = s;
+        sketch_dirty = true;
+    }
+    protected_cache(false);
+}
+
+// union other into this node while computing the similarity of other to each
+// of this node's two children; see BF::union_into_and_compare
+void BloomTree::union_into_and_compare(const BloomTree* other, int type, uint64_t sims[2], unsigned nb_threads) {
+    assert(children[0] != nullptr && children[1] != nullptr);
+    PerfScope perf(PERF_UNION, this);
+    protected_cache(true);
+    bf()->union_into_and_compare(other->bf(), children[0]->bf(), children[1]->bf(),
+        type, sims, nb_threads);
+    dirty = true;
+    update_sketch(other);
     protected_cache(false);
 }
 
@@ -304,6 +544,18 @@ BloomTree* read_bloom_tree(const std::string & filename, bool read_hashes) {
     return tree_root;
 }
 
+// the name of the hash function file given on the root line of a tree file
+std::string read_tree_hash_file(const std::string & filename) {
+    std::ifstream in(filename.c_str());
+    DIE_IF(!in, "Couldn't open bloom tree file " + filename);
+    std::string header;
+    getline(in, header);
+    std::vector<std::string> fields;
+    SplitString(Trim(header), ',', fields);
+    DIE_IF(fields.size() < 2, "Must specify hash file for root.");
+    return fields[1];
+}
+
 void write_bloom_tree_helper(std::ostream & out, BloomTree* root, int level=1) {
     std::string lstr(level, '*');
 
@@ -316,16 +568,21 @@ void write_bloom_tree_helper(std::ostream & out, BloomTree* root, int level=1) {
 }
 
 // write the bloom tree file format in a way that can be read by
-// read_bloom_tree()
+// read_bloom_tree(). The file is written to a temporary and renamed over
+// outfile, so a crash never leaves a partial tree file.
 void write_bloom_tree(
     const std::string & outfile, 
     BloomTree* root, 
     const std::string & matrix_file
 ) {
     std::cerr << "Writing to " << outfile << std::endl;
-    std::ofstream out(outfile.c_str());
+    std::string tmp = outfile + ".tmp";
+    std::ofstream out(tmp.c_str());
     out << root->name() << "," << matrix_file << std::endl;
     write_bloom_tree_helper(out, root);
+    out.close();
+    DIE_IF(!out, "Couldn't write " + tmp);
+    DIE_IF(rename(tmp.c_str(), outfile.c_str()) != 0, "Couldn't rename " + tmp + " to " + outfile);
     std::cerr << "Done." << std::endl;
 }
 
@@ -348,9 +605,13 @@ void write_compressed_bloom_tree(
     const std::string & matrix_file
 ) {
     std::cerr << "Writing to " << outfile << std::endl;
-    std::ofstream out(outfile.c_str());
+    std::string tmp = outfile + ".tmp";
+    std::ofstream out(tmp.c_str());
     out << root->name() << ".rrr," << matrix_file << std::endl;
     write_compressed_bloom_tree_helper(out, root);
+    out.close();
+    DIE_IF(!out, "Couldn't write " + tmp);
+    DIE_IF(rename(tmp.c_str(), outfile.c_str()) != 0, "Couldn't rename " + tmp + " to " + outfile);
     std::cerr << "Done." << std::endl;
 }
 
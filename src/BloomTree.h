@@ -5,10 +5,23 @@
 #include <queue>
 #include "Heap.h"
 #include "BF.h"
+#include "Sketch.h"
 
 // this is the max number of BF allowed in memory at once.
 extern int BF_INMEM_LIMIT;
 
+// when true, bf() counts cache hits; off by default, since every query
+// thread would update the one counter on each filter access
+extern bool CACHE_COUNTERS_ENABLED;
+
+// running totals of filter accesses, for reporting cache behaviour
+struct CacheCounters {
+    uint64_t hits;          // bf() calls that found the filter in memory
+                            // (only counted with CACHE_COUNTERS_ENABLED)
+    uint64_t misses;        // filters read from disk
+    uint64_t bytes_loaded;
+};
+
 class BloomTree {
 public:
     BloomTree(const std::string & f, HashPair hp, int nh);
@@ -20,16 +33,30 @@ public:
     int num_children() const;
     void set_parent(const BloomTree* p);
     const BloomTree* get_parent() const;
+    int depth() const;
     uint64_t similarity(BloomTree* other, int type) const;
+    uint64_t sketch_similarity(const BloomTree* other, int type) const;
+    const Sketch & sketch() const;
+    void set_sketch(const Sketch & s);
     std::tuple<uint64_t, uint64_t> b_similarity(BloomTree* other) const;
     BF* bf() const;
+    bool is_loaded() const;
+    BF* load_detached() const;
+    int num_hashes() const;
+    const HashPair & hash_pair() const;
 
     BloomTree* union_bloom_filters(const std::string & new_name, BloomTree* f2);
     void union_into(const BloomTree* other);
+    void recompute_union(const std::string & new_name = "");
+    void rename(const std::string & new_name);
+    void union_into_and_compare(const BloomTree* other, int type, uint64_t sims[2], unsigned nb_threads);
 
     int usage() const;
     void increment_usage() const;
+    void flush() const;
     static void protected_cache(bool b);
+    static void clear_cache();
+    static CacheCounters cache_counters();
 
 private:
     bool load() const;
@@ -37,6 +64,7 @@ private:
 
     static Heap<const BloomTree> bf_cache;
     static void drain_cache();
+    void update_sketch(const BloomTree* other);
 
     std::string filename;
     HashPair hashes;
@@ -48,10 +76,13 @@ private:
     BloomTree* parent;
     mutable int usage_count;
     mutable bool dirty;
+    mutable Sketch* node_sketch;
+    mutable bool sketch_dirty;
 };
 
 HashPair* get_hash_function(const std::string & matrix_file, int & nh);
 BloomTree* read_bloom_tree(const std::string & filename, bool read_hashes=true);
+std::string read_tree_hash_file(const std::string & filename);
 void write_bloom_tree(const std::string & outfile, BloomTree* root, const std::string & matrix_file);
 void write_compressed_bloom_tree(const std::string & outfile, BloomTree* root, const std::string & matrix_file);
 #endif
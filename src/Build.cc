@@ -2,11 +2,18 @@
 #include "BloomTree.h"
 #include "util.h"
 #include "Query.h"
+#include "Sketch.h"
+#include "ThreadPool.h"
+#include "WriteBehind.h"
 #include <cmath>
+#include <cstdio>
 #include <sstream>
 #include <cstring>
 #include <future>
+#include <atomic>
+#include <mutex>
 #include <algorithm>
+#include <set>
 #include "gzstream.h"
 
 #include <sys/mman.h>
@@ -14,6 +21,8 @@
 #include <jellyfish/file_header.hpp>
 #include <sdsl/bit_vectors.hpp>
 
+unsigned BUILD_THREADS = 16;
+
 // non-zero if bit is set
 inline char bit(char * buf, unsigned long bit) {
     char byte = buf[bit / 8];
@@ -51,7 +60,7 @@ sdsl::bit_vector* read_bit_vector_from_jf(const std::string & jfbloom_file) {
             (*b)[i] = 1;
         }
     }*/
-    delete buf;
+    delete[] buf;
     return b;
 }
 
@@ -100,196 +109,192 @@ unsigned number_nodes_in_complete_tree(unsigned n) {
 }
 
 
-/*
-// a very simple implementation of union
-sdsl::bit_vector* union_bv(const sdsl::bit_vector& b1, const sdsl::bit_vector& b2) {
-    sdsl::bit_vector* out = new sdsl::bit_vector(b1.size(), 0);
-    for (std::size_t i = 0; i < b1.size(); i++) {
-        (*out)[i] = b1[i] | b2[i];
+// the depth of position i in the array-based "tree"
+static unsigned complete_tree_depth(std::size_t i) {
+    unsigned d = 0;
+    while (i > 0) {
+        i = (i - 1) / 2;
+        d++;
     }
-    return out;
+    return d;
 }
-*/
-
 
+// positions of the leaves of the array-based "tree" of nb_nodes nodes, left
+// to right
+static void complete_tree_leaves(std::size_t pos, std::size_t nb_nodes, std::vector<std::size_t> & out) {
+    std::size_t left = complete_tree_child(pos, 0);
+    if (left >= nb_nodes) {
+        out.push_back(pos);
+        return;
+    }
+    complete_tree_leaves(left, nb_nodes, out);
+    complete_tree_leaves(complete_tree_child(pos, 1), nb_nodes, out);
+}
 
-// do a post-order traversal over the array-based "tree"
-sdsl::bit_vector* build_filters(
+// build a balanced tree with the leaves, in the given order, as its leaves
+// (a complete binary tree, except for the last level). Leaves may be filters
+// from "bt count" or jellyfish bloom filters, which are converted first.
+//
+// The unions are built one level at a time, deepest first, by a fixed pool
+// of BUILD_THREADS workers. A finished union stays in memory for its parent
+// while fewer than BF_INMEM_LIMIT are resident; otherwise the parent reads
+// it back from disk. If compress_out is given, a second pool writes the RRR
+// copy of each filter while the unions above it are built, and a compressed
+// tree file is written to compress_out.
+void balanced_build(
+    const std::string & hashes_file,
     const std::vector<std::string> & leaves,
-    std::vector<BloomTree*> & tree,
-    std::vector<sdsl::bit_vector*> & raw,
-    const HashPair & hashes, 
-    int nh,
-    std::size_t pos
+    const std::string & outf,
+    const std::string & compress_out
 ) {
-    // build the left bitvector (and saved rrr vector)
-    sdsl::bit_vector* bl = nullptr;
-    auto left = complete_tree_child(pos, 0);
-    if (left < tree.size()) {
-        if (raw[left] == nullptr) {
-            bl = build_filters(leaves, tree, raw, hashes, nh, left);
-        } else {
-            bl = raw[left];
-        }
-    }
-
-    // build the right bitvector (and saved rrr vector)
-    sdsl::bit_vector* br = nullptr;
-    auto right = complete_tree_child(pos, 1);
-    if (right < tree.size()) {
-        if (raw[right] == nullptr) {
-            br = build_filters(leaves, tree, raw, hashes, nh, right);
-        } else {
-            br = raw[right];
-        }
-    }
-
-    sdsl::bit_vector* u = nullptr;
-    std::string union_name;
-
-    // if interior node:
-    if (br != nullptr && bl != nullptr) {
-        std::cerr << "Creating union: " << pos << std::endl;
-        
-        // union the two filters & discard the children
-        u = union_bv_fast(*bl, *br);
-        raw[pos] = u;
-        raw[left] = nullptr;
-        raw[right] = nullptr;
-        delete bl;
-        delete br;
-        
-        // create the new name
-        std::ostringstream oss;
-        oss << "union" << pos << ".rrr";
-        union_name = oss.str();
-
-        std::cerr << "Unioning: " << tree[left]->name() << " with " <<
-            tree[right]->name() << " to " << union_name << std::endl;
-
-        // save the BT node
-        tree[pos] = new BloomTree(union_name, hashes, nh);
-        tree[pos]->set_child(0, tree[left]);
-        tree[pos]->set_child(1, tree[right]);
-
-    } else if (br == nullptr && br == nullptr) {
-        // we're a leaf, so what we should do is (1) read the JF bloom filter,
-        // (2) create a bv, (3) store a compressed rrr vector
-        union_name = leaves[tree.size() - pos - 1];
-        u = read_bit_vector_from_jf(union_name);
-        raw[pos] = u;
+    DIE_IF(leaves.empty(), "No filters to build a tree on.");
+    int nh = 0;
+    HashPair* hashes = get_hash_function(hashes_file, nh);
 
-        union_name = test_basename(union_name, std::string(".gz")) + ".rrr";
-        tree[pos] = new BloomTree(union_name, hashes, nh);
+    std::size_t nb_nodes = number_nodes_in_complete_tree(leaves.size());
+    std::size_t first_leaf = nb_nodes - leaves.size();
+    std::cerr << "Tree will have " << nb_nodes << " nodes" << std::endl;
 
-    } else {
-        DIE("Should not happen.");
+    std::vector<std::string> names(nb_nodes);
+    for (std::size_t pos = 0; pos < first_leaf; pos++) {
+        names[pos] = outf + "_union" + std::to_string(pos) + ".bf.bv";
     }
-    
-    // compress and write it out if it doesn't already exist
-    std::ifstream check(union_name.c_str());
-    if (!check) {
-        // convert and save compressed version
-        std::cerr << "Compressing to " << union_name << std::endl;
-        sdsl::rrr_vector<255> rrr(*u);
-        sdsl::store_to_file(rrr, union_name);
-        std::cerr << "Compressed RRR vector is " << sdsl::size_in_mega_bytes(rrr) << std::endl; 
-    } else {
-        check.close();
-        std::cerr << "Skipping compression because " << union_name << " already exists." << std::endl;
-    }
-
-    return u;
-}
 
-
-sdsl::bit_vector* build_filters_parallel(
-    const std::vector<std::string> & leaves, 
-    std::vector<BloomTree*> & tree,
-    const HashPair & hashes, 
-    int nh, 
-    unsigned level
-) {
-    std::vector<sdsl::bit_vector*> raw(tree.size(), nullptr);
-
-    /*
-    level 1 = [1,2]
-    level 2 = [3,4,5,6]
-    level 3 = [7,8,9,10,11,12,13, 14]
-    level 4 = [15,16,17,18, 19,20,21,22, 23,24,25,26, 27,28,29,30]
-    level i starts at 2^i-1, and continues for 2^i
-    */
-
-    unsigned biggest_complete_level = unsigned(log2(leaves.size()));
-    level = std::min(level, biggest_complete_level);
-
-    // the roots of the subtrees that we are going to run in parallel
-    std::size_t level_length = std::size_t(pow(2, level));
-    std::size_t level_start = level_length - 1;
-
-    std::cerr << "Parallel level = " << level << std::endl;
-    std::cerr << "Computing " << level_length << " roots at level " << level <<
-        " in parallel." << std::endl; 
-
-    // for each of the roots, start a build_filters() process.
-    std::vector<std::future<sdsl::bit_vector*> > F;
-    for (std::size_t p = level_start; p < level_start + level_length; ++p) {
-        F.emplace_back(
-            std::async(
-                std::launch::async,
-                [=, &leaves, &tree, &raw] () {
-                    return build_filters(leaves, tree, raw, hashes, nh, p);
+    ThreadPool unions(BUILD_THREADS);
+    ThreadPool compressions(std::max(1u, BUILD_THREADS / 2));
+    std::vector<std::future<void> > compressed;
+    std::mutex compressed_lock;
+    auto compress_later = [&](const std::string & fn) {
+        if (compress_out.empty()) return;
+        std::lock_guard<std::mutex> g(compressed_lock);
+        compressed.push_back(compressions.submit([fn]() { compress_filter_file(fn); }));
+    };
+
+    // name the leaves, converting any jellyfish filters
+    std::vector<std::size_t> leaf_pos;
+    complete_tree_leaves(0, nb_nodes, leaf_pos);
+    assert(leaf_pos.size() == leaves.size());
+    std::vector<std::future<void> > level;
+    for (std::size_t i = 0; i < leaves.size(); i++) {
+        std::string leaf = leaves[i];
+        std::string & name = names[leaf_pos[i]];
+        if (leaf.size() > 6 && leaf.substr(leaf.size() - 6) == ".bf.bv") {
+            name = leaf;
+            compress_later(name);
+            continue;
+        }
+        name = test_basename(leaf, std::string(".gz")) + ".bf.bv";
+        level.push_back(unions.submit([&, leaf, name]() {
+            sdsl::bit_vector* b = read_bit_vector_from_jf(leaf);
+            sdsl::store_to_file(*b, name);
+            delete b;
+            compress_later(name);
+        }));
+    }
+    for (auto & f : level) f.get();
+
+    // each union's bit vector is handed to its parent through raw; the
+    // wait at the end of each level orders those hand-offs
+    std::vector<sdsl::bit_vector*> raw(nb_nodes, nullptr);
+    std::atomic<int> resident(0);
+    unsigned max_depth = (first_leaf == 0) ? 0 : complete_tree_depth(first_leaf - 1);
+    for (int d = int(max_depth); first_leaf > 0 && d >= 0; d--) {
+        std::size_t level_start = (std::size_t(1) << d) - 1;
+        std::size_t level_end = std::min((std::size_t(1) << (d + 1)) - 1, first_leaf);
+        std::cerr << "Building " << (level_end - level_start) << " unions at depth " << d << std::endl;
+
+        level.clear();
+        for (std::size_t pos = level_start; pos < level_end; pos++) {
+            level.push_back(unions.submit([&, pos]() {
+                sdsl::bit_vector* b[2];
+                for (unsigned c = 0; c < 2; c++) {
+                    std::size_t child = complete_tree_child(pos, c);
+                    b[c] = raw[child];
+                    if (b[c] != nullptr) {
+                        raw[child] = nullptr;
+                        resident--;
+                    } else {
+                        b[c] = new sdsl::bit_vector();
+                        sdsl::load_from_file(*b[c], names[child]);
+                    }
                 }
-            )
-        );
+                sdsl::bit_vector* u = union_bv_fast(*b[0], *b[1]);
+                delete b[0];
+                delete b[1];
+
+                sdsl::store_to_file(*u, names[pos]);
+                compress_later(names[pos]);
+                if (resident++ < BF_INMEM_LIMIT) {
+                    raw[pos] = u;
+                } else {
+                    resident--;
+                    delete u;
+                }
+            }));
+        }
+        for (auto & f : level) f.get();
     }
+    delete raw[0];
 
-    std::cerr << "Waiting for subtrees to finish." << std::endl;
-    // join on all the threads
-    for (auto & f : F) {
-        f.wait();
+    std::vector<BloomTree*> v(nb_nodes, nullptr);
+    for (std::size_t pos = nb_nodes; pos-- > 0; ) {
+        v[pos] = new BloomTree(names[pos], *hashes, nh);
+        if (pos < first_leaf) {
+            v[pos]->set_child(0, v[complete_tree_child(pos, 0)]);
+            v[pos]->set_child(1, v[complete_tree_child(pos, 1)]);
+        }
     }
+    std::cerr << "Built the whole tree." << std::endl;
+    write_bloom_tree(outf, v[0], hashes_file);
 
-    // finish off the top of the tree
-    std::cerr << "Finishing top of tree in single thread mode." << std::endl;
-    return build_filters(leaves, tree, raw, hashes, nh, 0);
+    if (!compress_out.empty()) {
+        std::cerr << "Waiting for compression to finish." << std::endl;
+        for (auto & f : compressed) f.get();
+        write_compressed_bloom_tree(compress_out, v[0], hashes_file);
+    }
+    delete_bloom_tree(v[0]);
 }
 
 
-void build_bt_from_jfbloom(
-    const std::vector<std::string> & leaves, 
-    const std::string & outf,
-    unsigned parallel_level
-) {
-    // create the hashes
-    int nh = 0;
-    HashPair* hashes = get_hash_function(leaves[0], nh); 
-
-    // calculate the number of nodes in the tree
-    unsigned nb_nodes = number_nodes_in_complete_tree(leaves.size());
-    std::cerr << "Tree will have " << nb_nodes << " nodes" << std::endl;
+// moves each existing union of a tree to a new file the first time it is
+// changed, so that the tree file it was read from (and anything else using
+// its filters) stays valid until it is replaced
+class CopyOnWrite {
+public:
+    CopyOnWrite(const std::string & prefix) : prefix(prefix), next(0) {}
+
+    // a filter name under the prefix that isn't in use on disk
+    std::string fresh_name() {
+        std::string fn;
+        do {
+            fn = prefix + std::to_string(next++) + ".bf.bv";
+        } while (file_mtime(fn) != 0);
+        return fn;
+    }
 
-    // v holds the nodes of the semi-complete tree
-    std::vector<BloomTree*> v(nb_nodes, nullptr);
-    sdsl::bit_vector *u = build_filters_parallel(leaves, v, *hashes, nh, parallel_level);
-    std::cerr << "Built the whole tree." << std::endl;
-    write_bloom_tree(outf, v[0], leaves[0]);
+    // call before T's filter is changed
+    void before_change(BloomTree* T) {
+        if (!moved.insert(T).second) return;
+        std::string fn = fresh_name();
+        std::cerr << "Copying " << T->name() << " to " << fn << std::endl;
+        T->rename(fn);
+    }
 
-    // save uncompressed root for later merging
-    std::cerr << "Storing the root bitvector" << std::endl;
-    sdsl::store_to_file(*u, outf + ".root");
-    
-    // free the memory for the bloom nodes
-    delete u;
-    for (auto & p : v) {
-        delete p;
+    // T was made in this run, so it can be changed in place
+    void adopt(BloomTree* T) {
+        moved.insert(T);
     }
-}
 
+private:
+    std::string prefix;
+    unsigned next;
+    std::set<const BloomTree*> moved;
+};
 
 // walk down T, finding the best path; insert N (which could be a subtree) at the leaf
-// we come to, and union all the parents
-BloomTree* insert_bloom_tree(BloomTree* T, BloomTree* N, int type) {
+// we come to, and union all the parents. With cow, the existing unions on
+// the path are moved to new files before they are changed.
+BloomTree* insert_bloom_tree(BloomTree* T, BloomTree* N, int type, CopyOnWrite* cow = nullptr) {
 
     std::cerr << "Inserting leaf " << N->name() << " ... " << std::endl;
     // save the root to return
@@ -320,6 +325,7 @@ BloomTree* insert_bloom_tree(BloomTree* T, BloomTree* N, int type) {
                 << " at depth " << depth << std::endl;
 
             BloomTree* NewNode = T->union_bloom_filters(oss.str(), N);
+            if (cow != nullptr) cow->adopt(NewNode);
             std::cerr << "   1:" << NewNode->child(0)->name() << std::endl;
             std::cerr << "   2:" << NewNode->child(1)->name() << std::endl;
 
@@ -333,6 +339,7 @@ BloomTree* insert_bloom_tree(BloomTree* T, BloomTree* N, int type) {
             }
         } else if (T->num_children() == 1) {
             // union the new filter with this node
+            if (cow != nullptr) cow->before_change(T);
             T->union_into(N);
             
             // insert into first empty child
@@ -346,21 +353,49 @@ BloomTree* insert_bloom_tree(BloomTree* T, BloomTree* N, int type) {
             }
             DIE("Something is wrong!");
         } else {
-            // find the most similar child and move to it
+            if (cow != nullptr) cow->before_change(T);
+            uint64_t sims[2];
+            T->child(0)->increment_usage();
+            T->child(1)->increment_usage();
+            if (SKETCH_ENABLED) {
+                // choose the child by the sketches alone; only the filters
+                // on the path we take are read
+                for (int i = 0; i < 2; i++) {
+                    sims[i] = T->child(i)->sketch_similarity(N, type);
+                }
+            } else {
+                // start reading the grandchildren; the next step will need
+                // one pair of them, and the pass below takes long enough to
+                // hide most of the read
+                for (int i = 0; i < 2; i++) {
+                    for (int j = 0; j < 2; j++) {
+                        BloomTree* g = T->child(i)->child(j);
+                        if (g != nullptr && !g->is_loaded()) readahead_file(g->name());
+                    }
+                }
+
+                // find the most similar child, unioning the new filter into
+                // this node in the same pass
+                T->union_into_and_compare(N, type, sims, BUILD_THREADS);
+            }
+
             uint64_t best_sim = 0;
             best_child = -1;
             for (int i = 0; i < 2; i++) {
-                T->child(i)->increment_usage();
-                uint64_t sim = T->child(i)->similarity(N,type);
-                std::cerr << "Child " << i << " sim =" << sim << std::endl;
-                if (sim >= best_sim) {
-                    best_sim = sim;
+                std::cerr << "Child " << i << " sim =" << sims[i] << std::endl;
+                if (sims[i] >= best_sim) {
+                    best_sim = sims[i];
                     best_child = i;
                 }
             }
-            
-            // union the new filter with this node
-            T->union_into(N);
+
+            if (SKETCH_ENABLED) {
+                // the chosen child is read next; start that now, while we
+                // union the new filter with this node
+                BloomTree* next = T->child(best_child);
+                if (!next->is_loaded()) readahead_file(next->name());
+                T->union_into(N);
+            }
 
             // move the current ptr to the most similar child
             std::cerr << "Moving to " << ((best_child==0)?"left":"right") 
@@ -386,32 +421,263 @@ void delete_bloom_tree(BloomTree* T) {
     delete T;
 }
 
+// save every modified filter, then the topology, and free the tree
+void save_bloom_tree(BloomTree* root, const std::string & tree_file, const std::string & hashes_file) {
+    std::cerr << "Saving modified filters" << std::endl;
+    BloomTree::clear_cache();
+    write_bloom_tree(tree_file, root, hashes_file);
+    delete_bloom_tree(root);
+}
+
+static void collect_leaf_names(const BloomTree* T, std::set<std::string> & names) {
+    if (T->num_children() == 0) {
+        names.insert(T->name());
+    }
+    for (int i = 0; i < 2; i++) {
+        if (T->child(i) != nullptr) collect_leaf_names(T->child(i), names);
+    }
+}
+
+// insert new leaves into an existing (uncompressed) tree. Only the unions on
+// each insertion path, and the new ones the insertions create, are written;
+// the changed unions go to new files, and the tree file is replaced last, so
+// the old tree stays valid until then.
+void insert_leaves(
+    const std::string & tree_file,
+    const std::vector<std::string> & leaves,
+    int type
+) {
+    std::string hashes_file = read_tree_hash_file(tree_file);
+    BloomTree* root = read_bloom_tree(tree_file);
+    DIE_IF(root->name().substr(root->name().size() - 3) != ".bv",
+        "Can only insert into an uncompressed tree.");
+
+    std::set<std::string> existing;
+    collect_leaf_names(root, existing);
+    CopyOnWrite cow(tree_file + "_u");
+
+    for (const auto & leaf : leaves) {
+        if (!existing.insert(leaf).second) {
+            WARN("Skipping " + leaf + ": already in the tree.");
+            continue;
+        }
+        BloomTree* N = new BloomTree(leaf, root->hash_pair(), root->num_hashes());
+        root = insert_bloom_tree(root, N, type, &cow);
+    }
+
+    save_bloom_tree(root, tree_file, hashes_file);
+}
+
+// find the path from T down to the leaf with the given name
+static bool find_leaf(BloomTree* T, const std::string & name, std::vector<BloomTree*> & path) {
+    path.push_back(T);
+    if (T->num_children() == 0 && T->name() == name) {
+        return true;
+    }
+    for (int i = 0; i < 2; i++) {
+        if (T->child(i) != nullptr && find_leaf(T->child(i), name, path)) {
+            return true;
+        }
+    }
+    path.pop_back();
+    return false;
+}
+
+// remove a leaf from an existing (uncompressed) tree. Its parent union is
+// replaced by the leaf's sibling, and the unions above are recomputed from
+// their children into new files; nothing else is written. The tree file is
+// replaced last, so the old tree stays valid until then. The filter files of
+// the removed and recomputed nodes are left on disk.
+void remove_leaf(const std::string & tree_file, const std::string & leaf_name) {
+    std::string hashes_file = read_tree_hash_file(tree_file);
+    BloomTree* root = read_bloom_tree(tree_file);
+    DIE_IF(root->name().substr(root->name().size() - 3) != ".bv",
+        "Can only remove from an uncompressed tree.");
+
+    std::vector<BloomTree*> path;
+    DIE_IF(!find_leaf(root, leaf_name, path), "No leaf named " + leaf_name + " in the tree.");
+
+    // the subtree to detach: the leaf, plus any ancestors it is the only
+    // child of
+    std::size_t d = path.size() - 1;
+    while (d > 0 && path[d-1]->num_children() == 1) d--;
+    DIE_IF(d == 0, "Can't remove the only leaf of a tree.");
+
+    // the parent of that subtree is left with one child, so it is replaced
+    // by that child
+    BloomTree* P = path[d-1];
+    BloomTree* S = P->child((P->child(0) == path[d]) ? 1 : 0);
+    if (d == 1) {
+        root = S;
+        S->set_parent(nullptr);
+    } else {
+        BloomTree* G = path[d-2];
+        G->set_child((G->child(0) == P) ? 0 : 1, S);
+    }
+
+    for (std::size_t i = d - 1; i < path.size(); i++) {
+        if (path[i]->num_children() > 0) {
+            std::cerr << "No longer used: " << path[i]->name() << std::endl;
+        }
+        delete path[i];
+    }
+
+    // the remaining ancestors, deepest first
+    CopyOnWrite cow(tree_file + "_u");
+    for (std::size_t i = (d >= 2) ? d - 1 : 0; i-- > 0; ) {
+        std::string fn = cow.fresh_name();
+        std::cerr << "Recomputing " << path[i]->name() << " as " << fn << std::endl;
+        path[i]->recompute_union(fn);
+    }
+
+    save_bloom_tree(root, tree_file, hashes_file);
+}
+
+static std::size_t count_leaves(const BloomTree* T) {
+    if (T->num_children() == 0) return 1;
+    std::size_t n = 0;
+    for (int i = 0; i < 2; i++) {
+        if (T->child(i) != nullptr) n += count_leaves(T->child(i));
+    }
+    return n;
+}
+
+// the nodes at the given depth below T (or leaves above it), left to right;
+// the unions above them are deleted
+static void split_tree(BloomTree* T, int depth, std::vector<BloomTree*> & subtrees) {
+    if (depth == 0 || T->num_children() == 0) {
+        subtrees.push_back(T);
+        return;
+    }
+    for (int i = 0; i < 2; i++) {
+        if (T->child(i) != nullptr) split_tree(T->child(i), depth - 1, subtrees);
+    }
+    std::cerr << "No longer used: " << T->name() << std::endl;
+    delete T;
+}
+
+static std::string read_file(const std::string & fn) {
+    std::ifstream in(fn.c_str(), std::ios::binary);
+    DIE_IF(!in, "Couldn't open " + fn);
+    std::ostringstream oss;
+    oss << in.rdbuf();
+    return oss.str();
+}
+
+// combine two trees built with the same hash function into one, written to
+// outf. With split_depth == 0, the two roots become the children of a new
+// root union. Otherwise the smaller tree is cut into its subtrees at that
+// depth, and each is inserted into the larger tree by similarity. Only the
+// new root or the unions on the insertion paths are written, the latter to
+// new <outf>_uN files, so both input trees and their files are left as they
+// were.
+void merge_trees(
+    const std::string & tree_a,
+    const std::string & tree_b,
+    const std::string & outf,
+    int split_depth,
+    int type
+) {
+    std::string hashes_file = read_tree_hash_file(tree_a);
+    std::string hashes_b = read_tree_hash_file(tree_b);
+    DIE_IF(hashes_file != hashes_b && read_file(hashes_file) != read_file(hashes_b),
+        "Trees must be built with the same hash function.");
+
+    BloomTree* a = read_bloom_tree(tree_a);
+    BloomTree* b = read_bloom_tree(tree_b);
+    for (const BloomTree* t : {a, b}) {
+        DIE_IF(t->name().substr(t->name().size() - 3) != ".bv",
+            "Can only merge uncompressed trees.");
+    }
+
+    // compare sizes without caching the roots: split_tree may delete b's
+    BF* fa = a->load_detached();
+    BF* fb = b->load_detached();
+    bool same_size = fa->size() == fb->size();
+    delete fa;
+    delete fb;
+    DIE_IF(!same_size, "Trees must have filters of the same size.");
+
+    BloomTree* root = nullptr;
+    if (split_depth <= 0) {
+        std::cerr << "Joining " << a->name() << " and " << b->name() << std::endl;
+        root = a->union_bloom_filters(outf + "_root.bf.bv", b);
+    } else {
+        if (count_leaves(a) < count_leaves(b)) std::swap(a, b);
+        std::vector<BloomTree*> subtrees;
+        split_tree(b, split_depth, subtrees);
+        std::cerr << "Inserting " << subtrees.size() << " subtrees into " << a->name() << std::endl;
+        root = a;
+        CopyOnWrite cow(outf + "_u");
+        for (BloomTree* N : subtrees) {
+            N->set_parent(nullptr);
+            root = insert_bloom_tree(root, N, type, &cow);
+        }
+    }
+
+    save_bloom_tree(root, outf, hashes_file);
+}
+
 // build the tree by repeated insertion
+static void flush_tree(const BloomTree* T) {
+    T->flush();
+    for (int i = 0; i < 2; i++) {
+        if (T->child(i) != nullptr) flush_tree(T->child(i));
+    }
+}
+
+// name of the checkpoint tree file for a build writing to outf
+static std::string checkpoint_file(const std::string & outf) {
+    return outf + ".ckpt";
+}
+
+// save every changed filter (each by atomic rename), then the topology to
+// the checkpoint file, also by rename. The leaves of the checkpoint tree are
+// always the first ones of the leaf list, so their number says where to
+// resume.
+static void write_checkpoint(BloomTree* root, const std::string & outf, const std::string & hashes_file) {
+    flush_tree(root);
+    flush_writes();
+    std::string ckpt = checkpoint_file(outf);
+    write_bloom_tree(ckpt, root, hashes_file);
+}
+
+// build the tree by repeated insertion. Every checkpoint_every leaves (if
+// non-zero) a checkpoint is written; with resume, the build continues from
+// the checkpoint of an earlier run.
 void dynamic_build(
     const std::string & hashes_file,
     const std::vector<std::string> & leaves, 
     const std::string & outf,
     //const std::string & bloom_storage,
-    int type
+    int type,
+    unsigned checkpoint_every,
+    bool resume
 ) {
     // create the hashes
     int nh = 0;
     HashPair* hashes = get_hash_function(hashes_file, nh); 
 
     BloomTree* root = nullptr;
+    std::size_t first = 0;
+    if (resume && file_size(checkpoint_file(outf)) > 0) {
+        root = read_bloom_tree(checkpoint_file(outf));
+        std::set<std::string> done;
+        collect_leaf_names(root, done);
+        first = done.size();
+        DIE_IF(first > leaves.size()
+            || !std::all_of(leaves.begin(), leaves.begin() + first,
+                [&](const std::string & l) { return done.count(l) != 0; }),
+            "Checkpoint doesn't match the leaf list.");
+        std::cerr << "Resuming after " << first << " leaves." << std::endl;
+    } else if (resume) {
+        WARN("No checkpoint to resume from; starting over.");
+    }
     
-    //int count = 0;
     // for every leaf
     std::cerr << "Inserting leaves into tree..." << std::endl;
-    for (const auto & leaf : leaves) {
-        /*
-        // read JF filter and save it as a bv
-        sdsl::bit_vector* f = read_bit_vector_from_jf(leaf);
-        std::string filter_name = test_basename(leaf, std::string(".gz")) + ".bv";
-        std::string store_name = bloom_storage;
-        store_name.append(filter_name);
-        sdsl::store_to_file(*f, store_name);
-        */
+    for (std::size_t i = first; i < leaves.size(); i++) {
+        const std::string & leaf = leaves[i];
 
         // create the node that points to the filter we just saved
         BloomTree* N = new BloomTree(leaf, *hashes, nh);
@@ -419,23 +685,20 @@ void dynamic_build(
         //  insert this new leaf
         root = insert_bloom_tree(root, N, type);
 
-	/*
-        count++;
-        if (count % 100 == 0){
-            std::string temp_out = outf;
-            temp_out.append("_");
-            temp_out.append(std::to_string(count));
-            draw_bt(root, temp_out);
+        if (checkpoint_every > 0 && (i + 1) % checkpoint_every == 0 && i + 1 < leaves.size()) {
+            std::cerr << "Checkpoint after " << (i + 1) << " leaves." << std::endl;
+            write_checkpoint(root, outf, hashes_file);
         }
-	*/
     }
     
-    // write the tree file
+    // write the tree file once every filter it names is on disk
     std::cerr << "Built the whole tree." << std::endl;
+    std::cerr << "Saving dirty filters" << std::endl;
+    flush_tree(root);
+    flush_writes();
     write_bloom_tree(outf, root, hashes_file);
+    std::remove(checkpoint_file(outf).c_str());
     
-    // delete the tree (which saves it)
-    std::cerr << "Freeing tree (and saving dirty filters)" << std::endl;
     delete_bloom_tree(root);
 }
 
@@ -4,9 +4,20 @@
 #include <string>
 #include <vector>
 
+class BloomTree;
+
+// number of threads used for each step of an insertion
+extern unsigned BUILD_THREADS;
+
 std::vector<std::string> read_filter_list(const std::string & inf);
 void convert_jfbloom_to_rrr(const std::string & jfbloom_file, const std::string & out_file);
-void build_bt_from_jfbloom(const std::vector<std::string> & leaves, const std::string & outf, unsigned parallel_level);
-void dynamic_build(const std::string & hashes_file, const std::vector<std::string> & leaves, const std::string & outf, const int type);
+void balanced_build(const std::string & hashes_file, const std::vector<std::string> & leaves, const std::string & outf, const std::string & compress_out);
+void delete_bloom_tree(BloomTree* T);
+void save_bloom_tree(BloomTree* root, const std::string & tree_file, const std::string & hashes_file);
+void insert_leaves(const std::string & tree_file, const std::vector<std::string> & leaves, int type);
+void remove_leaf(const std::string & tree_file, const std::string & leaf_name);
+void merge_trees(const std::string & tree_a, const std::string & tree_b, const std::string & outf, int split_depth, int type);
+void dynamic_build(const std::string & hashes_file, const std::vector<std::string> & leaves, const std::string & outf, const int type,
+    unsigned checkpoint_every = 0, bool resume = false);
 
 #endif
@@ -0,0 +1,296 @@
+#include "Cluster.h"
+#include "Build.h"
+#include "BloomTree.h"
+#include "Sketch.h"
+#include "util.h"
+
+#include <algorithm>
+#include <cassert>
+#include <atomic>
+#include <queue>
+#include <random>
+#include <thread>
+#include <tuple>
+#include <unordered_map>
+
+// each cluster is indexed under this many of its smallest hash values
+static const std::size_t CLUSTER_INDEX_VALUES = 64;
+
+// at most this many candidates are compared when finding a neighbour
+static const std::size_t CLUSTER_MAX_CANDIDATES = 512;
+
+namespace {
+
+// a node of the merge tree: a leaf (children == -1) or the union of two
+// earlier clusters
+struct Cluster {
+    Sketch sketch;
+    int children[2];
+    std::string filename;
+    int height;
+    bool alive;
+};
+
+// a candidate merge; the queue holds the most similar pair on top
+using Merge = std::tuple<uint64_t, int, int>;
+
+class Clustering {
+public:
+    Clustering(std::vector<Cluster> & clusters, int type) :
+        clusters(clusters),
+        type(type),
+        nb_alive(0),
+        rng(20150101)
+    {
+        for (std::size_t i = 0; i < clusters.size(); i++) {
+            index_cluster(int(i));
+            add_live(int(i));
+            nb_alive++;
+        }
+    }
+
+    // merge until one cluster is left; returns its index
+    int run(const std::string & union_prefix) {
+        for (std::size_t i = 0; i < clusters.size(); i++) {
+            push_nearest(int(i));
+        }
+
+        while (nb_alive > 1) {
+            // every live cluster has one entry in the queue
+            assert(!queue.empty());
+            Merge m = queue.top();
+            queue.pop();
+            int a = std::get<1>(m), b = std::get<2>(m);
+            if (!clusters[a].alive) continue;
+            if (!clusters[b].alive) {
+                // a's neighbour has been merged away; look again
+                push_nearest(a);
+                continue;
+            }
+
+            int c = merge(a, b, union_prefix);
+            push_nearest(c);
+        }
+
+        for (std::size_t i = 0; i < clusters.size(); i++) {
+            if (clusters[i].alive) return int(i);
+        }
+        DIE("No clusters.");
+        return -1;
+    }
+
+private:
+    // the live clusters, in no order, so a random few can be drawn in O(1)
+    void add_live(int i) {
+        if (live_pos.size() <= std::size_t(i)) live_pos.resize(i + 1, -1);
+        live_pos[i] = int(live.size());
+        live.push_back(i);
+    }
+
+    void remove_live(int i) {
+        int p = live_pos[i];
+        live[p] = live.back();
+        live_pos[live[p]] = p;
+        live.pop_back();
+        live_pos[i] = -1;
+    }
+
+    void index_cluster(int i) {
+        const std::vector<uint64_t> & v = clusters[i].sketch.values();
+        for (std::size_t j = 0; j < v.size() && j < CLUSTER_INDEX_VALUES; j++) {
+            index[v[j]].push_back(i);
+        }
+    }
+
+    // find the most similar live cluster among those that share one of i's
+    // smallest hash values (or, if there are none, among a random sample of
+    // CLUSTER_MAX_CANDIDATES of them) and queue the pair
+    void push_nearest(int i) {
+        std::vector<int> candidates;
+        const std::vector<uint64_t> & v = clusters[i].sketch.values();
+        for (std::size_t j = 0; j < v.size() && j < CLUSTER_INDEX_VALUES; j++) {
+            auto it = index.find(v[j]);
+            if (it == index.end()) continue;
+            std::vector<int> & posting = it->second;
+            posting.erase(std::remove_if(posting.begin(), posting.end(),
+                [this](int c) { return !clusters[c].alive; }), posting.end());
+            for (int c : posting) {
+                if (c != i) candidates.push_back(c);
+            }
+            if (candidates.size() >= CLUSTER_MAX_CANDIDATES) break;
+        }
+        if (candidates.empty()) {
+            if (live.size() <= CLUSTER_MAX_CANDIDATES + 1) {
+                for (int c : live) {
+                    if (c != i) candidates.push_back(c);
+                }
+            } else {
+                std::uniform_int_distribution<std::size_t> pick(0, live.size() - 1);
+                for (std::size_t j = 0; j < CLUSTER_MAX_CANDIDATES; j++) {
+                    int c = live[pick(rng)];
+                    if (c != i) candidates.push_back(c);
+                }
+            }
+        }
+        std::sort(candidates.begin(), candidates.end());
+        candidates.erase(std::unique(candidates.begin(), candidates.end()), candidates.end());
+
+        int best = -1;
+        uint64_t best_sim = 0;
+        for (int c : candidates) {
+            uint64_t sim = clusters[i].sketch.similarity(clusters[c].sketch, type);
+            if (best == -1 || sim > best_sim) {
+                best_sim = sim;
+                best = c;
+            }
+        }
+        if (best != -1) {
+            queue.emplace(best_sim, i, best);
+        }
+    }
+
+    int merge(int a, int b, const std::string & union_prefix) {
+        Cluster c;
+        c.sketch = clusters[a].sketch;
+        c.sketch.merge(clusters[b].sketch);
+        c.children[0] = a;
+        c.children[1] = b;
+        c.height = std::max(clusters[a].height, clusters[b].height) + 1;
+        c.alive = true;
+        c.filename = union_prefix + std::to_string(clusters.size()) + ".bf.bv";
+
+        clusters[a].alive = false;
+        clusters[b].alive = false;
+        remove_live(a);
+        remove_live(b);
+        clusters.push_back(c);
+        nb_alive--;
+
+        int i = int(clusters.size()) - 1;
+        index_cluster(i);
+        add_live(i);
+        return i;
+    }
+
+    std::vector<Cluster> & clusters;
+    int type;
+    std::size_t nb_alive;
+    std::unordered_map<uint64_t, std::vector<int> > index;
+    std::priority_queue<Merge> queue;
+    std::vector<int> live;
+    std::vector<int> live_pos;  // position of each cluster in live, or -1
+    std::mt19937_64 rng;
+};
+
+// run f(i) for i in [0, n) on up to nb_threads threads
+template <typename F>
+void parallel_for(std::size_t n, unsigned nb_threads, F f) {
+    std::atomic<std::size_t> next(0);
+    auto worker = [&]() {
+        for (std::size_t i = next++; i < n; i = next++) {
+            f(i);
+        }
+    };
+    std::vector<std::thread> threads;
+    for (unsigned t = 1; t < nb_threads && t < n; t++) {
+        threads.emplace_back(worker);
+    }
+    worker();
+    for (auto & th : threads) {
+        th.join();
+    }
+}
+
+// the leaf's sketch, from its sidecar if that is up to date or computed from
+// the filter
+Sketch leaf_sketch(const std::string & leaf, const HashPair & hashes, int nh) {
+    Sketch s;
+    if (sketch_current(leaf) && s.load(sketch_file(leaf))) return s;
+
+    BF* f = load_bf_from_file(leaf, hashes, nh);
+    f->load();
+    s = Sketch(SKETCH_SIZE, f->size());
+    f->sketch_into(s);
+    delete f;
+    s.save(sketch_file(leaf));
+    return s;
+}
+
+BloomTree* make_tree(const std::vector<Cluster> & clusters, int i, const HashPair & hashes, int nh) {
+    BloomTree* t = new BloomTree(clusters[i].filename, hashes, nh);
+    if (clusters[i].children[0] != -1) {
+        for (int c = 0; c < 2; c++) {
+            t->set_child(c, make_tree(clusters, clusters[i].children[c], hashes, nh));
+        }
+    }
+    return t;
+}
+
+} // namespace
+
+// build a tree over the leaves in one go: sketch every leaf, greedily merge
+// the most similar pair of clusters (by sketch) until one is left, then
+// write the union filters bottom up.
+void cluster_build(
+    const std::string & hashes_file,
+    const std::vector<std::string> & leaves,
+    const std::string & outf,
+    int type
+) {
+    DIE_IF(leaves.empty(), "No filters to build a tree on.");
+    for (const auto & leaf : leaves) {
+        DIE_IF(leaf.size() < 3 || leaf.substr(leaf.size() - 3) != ".bv",
+            "Can only cluster uncompressed filters: " + leaf);
+    }
+    int nh = 0;
+    HashPair* hashes = get_hash_function(hashes_file, nh);
+
+    // each worker holds at most one filter while sketching, and three (two
+    // children and their union) while materializing
+    unsigned sketch_threads = std::max(1u, std::min<unsigned>(BUILD_THREADS, BF_INMEM_LIMIT));
+    unsigned union_threads = std::max(1u, std::min<unsigned>(BUILD_THREADS, BF_INMEM_LIMIT / 3));
+
+    std::cerr << "Sketching " << leaves.size() << " filters..." << std::endl;
+    std::vector<Cluster> clusters(leaves.size());
+    parallel_for(leaves.size(), sketch_threads, [&](std::size_t i) {
+        clusters[i].sketch = leaf_sketch(leaves[i], *hashes, nh);
+        clusters[i].children[0] = clusters[i].children[1] = -1;
+        clusters[i].filename = leaves[i];
+        clusters[i].height = 0;
+        clusters[i].alive = true;
+    });
+
+    std::cerr << "Clustering..." << std::endl;
+    clusters.reserve(2 * leaves.size() - 1);
+    Clustering clustering(clusters, type);
+    int root = clustering.run(outf + "_union");
+
+    // materialize the unions one height at a time; all the unions at a
+    // height only depend on lower ones
+    int max_height = clusters[root].height;
+    for (int h = 1; h <= max_height; h++) {
+        std::vector<int> todo;
+        for (std::size_t i = 0; i < clusters.size(); i++) {
+            if (clusters[i].height == h) todo.push_back(int(i));
+        }
+        std::cerr << "Writing " << todo.size() << " unions at height " << h << std::endl;
+        parallel_for(todo.size(), union_threads, [&](std::size_t j) {
+            const Cluster & c = clusters[todo[j]];
+            BF* f0 = load_bf_from_file(clusters[c.children[0]].filename, *hashes, nh);
+            f0->load();
+            BF* f1 = load_bf_from_file(clusters[c.children[1]].filename, *hashes, nh);
+            f1->load();
+            BF* u = f0->union_with(c.filename, f1);
+            delete f0;
+            delete f1;
+            u->save();
+            delete u;
+            c.sketch.save(sketch_file(c.filename));
+        });
+    }
+
+    BloomTree* root_node = make_tree(clusters, root, *hashes, nh);
+    std::cerr << "Built the whole tree." << std::endl;
+    write_bloom_tree(outf, root_node, hashes_file);
+    delete_bloom_tree(root_node);
+}
@@ -0,0 +1,14 @@
+#ifndef CLUSTER_H
+#define CLUSTER_H
+
+#include <string>
+#include <vector>
+
+void cluster_build(
+    const std::string & hashes_file,
+    const std::vector<std::string> & leaves,
+    const std::string & outf,
+    int type
+);
+
+#endif
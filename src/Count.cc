@@ -1,6 +1,9 @@
 #include "Count.h"
 #include "Kmers.h"
 #include "BF.h"
+#include "util.h"
+#include "StreamCount.h"
+#include "ThreadPool.h"
 #include <jellyfish/mer_dna_bloom_counter.hpp>
 #include <jellyfish/file_header.hpp>
 #include <sdsl/bit_vectors.hpp>
@@ -11,7 +14,14 @@
 #include <jellyfish/stream_manager.hpp>
 #include <jellyfish/mer_overlap_sequence_parser.hpp>
 #include <jellyfish/mer_iterator.hpp>
+#include <jellyfish/binary_dumper.hpp>
 
+#include <algorithm>
+#include <deque>
+#include <fstream>
+#include <future>
+#include <sstream>
+#include <thread>
 #include <vector>
 
 /*==== COPIED FROM THE JF count_dump example ====*/
@@ -49,6 +59,180 @@ public:
 /*=== END COPY ===*/
 
 
+// jellyfish default counting values
+static const uint32_t num_reprobes = 126;
+static const uint32_t counter_len = 7;
+static const bool canonical = true;
+
+// bounds on the initial size of the kmer hash
+static const uint64_t COUNT_MIN_HASH_SIZE = 10000000;
+static const uint64_t COUNT_MAX_HASH_SIZE = uint64_t(1) << 31;
+
+// the initial hash takes at most this share (1 / HASH_MEMORY_SHARE) of the
+// free memory: a batch holds two hashes, and either may still grow
+static const uint64_t HASH_MEMORY_SHARE = 4;
+
+// a starting size for the hash when counting infilen: a guess at its number
+// of distinct kmers from its size, so the hash rarely has to grow (each
+// growth rehashes everything counted so far), within the free memory
+static uint64_t estimate_hash_size(const std::string & infilen) {
+    uint64_t bytes = file_size(infilen);
+    std::ifstream in(infilen.c_str());
+    bool fastq = in.peek() == '@';
+    uint64_t bases = fastq ? bytes / 2 : bytes;
+
+    // read errors make most kmers distinct at low coverage, repeats make
+    // them shared at high coverage; half the bases is a middle ground
+    uint64_t size = std::min(COUNT_MAX_HASH_SIZE, std::max(COUNT_MIN_HASH_SIZE, bases / 2));
+
+    // don't commit more than a share of the free memory up front; past that
+    // the hash grows as needed, as it did before it was presized. Each entry
+    // holds the rest of the key, the counter and the reprobe offset.
+    uint64_t entry_bytes = (2 * jellyfish::mer_dna::k() + counter_len + 7) / 8 + 1;
+    uint64_t free_bytes = available_memory();
+    if (free_bytes != 0) {
+        uint64_t fit = free_bytes / HASH_MEMORY_SHARE / entry_bytes;
+        size = std::min(size, std::max(COUNT_MIN_HASH_SIZE, fit));
+    }
+    return size;
+}
+
+// run JF count over the file into a new hash
+static mer_hash_type* count_kmers(const std::string & infilen, int num_threads) {
+    uint64_t hash_size = estimate_hash_size(infilen);
+    mer_hash_type* mer_hash = new mer_hash_type(hash_size, jellyfish::mer_dna::k()*2, counter_len, num_threads, num_reprobes);
+
+    // create a mock up of the array of file names
+    std::vector<std::string> files;
+    files.push_back(infilen);
+
+    // count the kmers
+    mer_counter counter(num_threads, *mer_hash, files.begin(), files.end(), canonical);
+    counter.exec_join(num_threads);
+    return mer_hash;
+}
+
+// counts at or above the last bin share it in a count histogram
+static const unsigned HISTO_BINS = 256;
+
+// the cutoff used when a histogram has no valley
+static const unsigned FALLBACK_CUTOFF = 3;
+
+// the valley must be at a count no higher than this, and the genomic peak
+// beyond it must be this many times more common than the valley
+static const unsigned VALLEY_MAX_COUNT = 20;
+static const double PEAK_FACTOR = 1.5;
+
+// warn when the cutoff drops more than this fraction of the distinct kmers
+static const double MAX_DROPPED_FRACTION = 0.95;
+
+// pick the cutoff at the valley between the error kmers, most of them seen
+// once, and the genomic peak: the first count c, among the low counts, whose
+// successor is more common, provided a clear peak follows. Kmers seen c times
+// or more are kept. A shallow sample's histogram only falls (apart from
+// noise in the tail) and has no peak to separate, so it gets FALLBACK_CUTOFF.
+static unsigned choose_cutoff(const std::vector<uint64_t> & histo) {
+    unsigned cutoff = 0;
+    for (unsigned c = 1; c <= VALLEY_MAX_COUNT && c + 2 < histo.size(); c++) {
+        if (histo[c + 1] <= histo[c]) continue;
+        // the last bin holds every higher count, so it can't be a peak
+        uint64_t peak = *std::max_element(histo.begin() + c + 1, histo.end() - 1);
+        if (double(peak) >= PEAK_FACTOR * double(std::max<uint64_t>(1, histo[c]))) {
+            cutoff = c;
+        }
+        break;
+    }
+    if (cutoff == 0) {
+        WARN("No valley in the count histogram; using cutoff " + std::to_string(FALLBACK_CUTOFF));
+        cutoff = FALLBACK_CUTOFF;
+    }
+
+    uint64_t distinct = 0, dropped = 0;
+    for (unsigned c = 1; c < histo.size(); c++) {
+        distinct += histo[c];
+        if (c < cutoff) dropped += histo[c];
+    }
+    if (distinct > 0 && double(dropped) > MAX_DROPPED_FRACTION * double(distinct)) {
+        WARN("Cutoff " + std::to_string(cutoff) + " drops " + std::to_string(dropped)
+            + " of " + std::to_string(distinct) + " distinct kmers");
+    }
+    return cutoff;
+}
+
+// record how a filter was made next to it, in <filter>.info
+static void write_count_info(const std::string & outfilen, unsigned cutoff_count, const BF & bf) {
+    std::ofstream out((outfilen + ".info").c_str());
+    DIE_IF(!out, "Couldn't write " + outfilen + ".info");
+    out << "cutoff\t" << cutoff_count << "\n"
+        << "fill_ratio\t" << double(bf.count_ones()) / double(bf.size()) << std::endl;
+}
+
+// the histogram of kmer counts in the hash, built over num_threads slices
+static std::vector<uint64_t> count_histogram(const mer_hash_type & mer_hash, int num_threads) {
+    const auto jf_ary = mer_hash.ary();
+    std::vector<std::vector<uint64_t> > partial(num_threads, std::vector<uint64_t>(HISTO_BINS, 0));
+    std::vector<std::thread> threads;
+    for (int t = 0; t < num_threads; t++) {
+        threads.emplace_back([&, t]() {
+            auto it = jf_ary->eager_slice(t, num_threads);
+            while (it.next()) {
+                partial[t][std::min<uint64_t>(it.val(), HISTO_BINS - 1)]++;
+            }
+        });
+    }
+    for (auto & th : threads) {
+        th.join();
+    }
+    std::vector<uint64_t> histo(HISTO_BINS, 0);
+    for (const auto & p : partial) {
+        for (unsigned c = 0; c < HISTO_BINS; c++) histo[c] += p[c];
+    }
+    return histo;
+}
+
+// build a BF from the kmers counted at least cutoff_count times, and save it.
+// The hash is split into num_threads slices, each added by its own thread.
+// With CUTOFF_AUTO, the cutoff is chosen from the sample's own count
+// histogram and recorded, with the fill ratio, in <filter>.info.
+static void populate_filter(
+    const mer_hash_type & mer_hash,
+    const std::string & outfilen,
+    HashPair hp,
+    int nh,
+    uint64_t bf_size,
+    int num_threads,
+    unsigned cutoff_count
+) {
+    bool adaptive = cutoff_count == CUTOFF_AUTO;
+    if (adaptive) {
+        cutoff_count = choose_cutoff(count_histogram(mer_hash, num_threads));
+        std::cerr << "Chose cutoff " << cutoff_count << " for " << outfilen << std::endl;
+    }
+
+    // build the BF
+    UncompressedBF bf(outfilen, hp, nh, bf_size);
+
+    // add each kmer to the BF
+    const auto jf_ary = mer_hash.ary();
+    std::cerr << "Right before cutoff count: " << cutoff_count << std::endl;
+    std::vector<std::thread> threads;
+    for (int t = 0; t < num_threads; t++) {
+        threads.emplace_back([&, t]() {
+            auto it = jf_ary->eager_slice(t, num_threads);
+            while (it.next()) {
+                if (it.val() >= cutoff_count) {
+                    bf.add_concurrent(hash_kmer(hp, it.key()));
+                }
+            }
+        });
+    }
+    for (auto & th : threads) {
+        th.join();
+    }
+    bf.save();
+    if (adaptive) write_count_info(outfilen, cutoff_count, bf);
+}
+
 // run JF count, and build a BF and save it to disk
 
 enum OPERATION { COUNT, PRIME, UPDATE };
@@ -62,38 +246,177 @@ bool count(
     int num_threads,
     unsigned cutoff_count
     ) {
-    
-    // jellyfish default counting values
-    const uint64_t hash_size = 10000000;
-    const uint32_t num_reprobes = 126;
-    const uint32_t counter_len = 7;
-    const bool canonical = true;
+    mer_hash_type* mer_hash = count_kmers(infilen, num_threads);
+    populate_filter(*mer_hash, outfilen, hp, nh, bf_size, num_threads, cutoff_count);
+    delete mer_hash;
+    return true;
+}
 
-    // create the hash
-    mer_hash_type mer_hash(hash_size, jellyfish::mer_dna::k()*2, counter_len, num_threads, num_reprobes);
+// kmers handed to a worker at a time when reading a jellyfish database
+static const std::size_t JF_BATCH_SIZE = 1 << 16;
 
-    // create a mock up of the array of file names
-    std::vector<std::string> files;
-    files.push_back(infilen);
+// open a jellyfish database and read its header, checking that its kmers
+// can go into filters made with the current hash file
+static void open_jf(const std::string & jffilen, std::ifstream & in, jellyfish::file_header & header) {
+    in.open(jffilen.c_str(), std::ios::in | std::ios::binary);
+    DIE_IF(!in, "Couldn't open " + jffilen);
+    DIE_IF(!header.read(in), "Couldn't parse jellyfish header of " + jffilen);
+    DIE_IF(header.format() != "binary/sorted",
+        jffilen + " is in format " + header.format() + "; only binary jellyfish databases can be read");
+    DIE_IF(header.key_len() / 2 != jellyfish::mer_dna::k(),
+        jffilen + " was counted with k=" + std::to_string(header.key_len() / 2)
+        + " but the hash file uses k=" + std::to_string(jellyfish::mer_dna::k()));
+    DIE_IF(!header.canonical(), jffilen + " wasn't counted with canonical kmers (jellyfish count -C)");
+}
 
-    // count the kmers
-    mer_counter counter(num_threads, mer_hash, files.begin(), files.end(), canonical);
-    counter.exec_join(num_threads);
+// the histogram of kmer counts in a jellyfish database: one extra pass over
+// the file, which is cheap next to hashing every kept kmer
+static std::vector<uint64_t> jf_histogram(const std::string & jffilen) {
+    std::ifstream in;
+    jellyfish::file_header header;
+    open_jf(jffilen, in, header);
+    jellyfish::binary_reader<jellyfish::mer_dna, uint64_t> reader(in, &header);
+    std::vector<uint64_t> histo(HISTO_BINS, 0);
+    while (reader.next()) {
+        histo[std::min<uint64_t>(reader.val(), HISTO_BINS - 1)]++;
+    }
+    return histo;
+}
+
+// build a BF from a jellyfish database written by "jellyfish count"
+// (binary format, the default), keeping the kmers counted at least
+// cutoff_count times. The database is read on this thread; hashing and
+// setting bits is done by num_threads workers, a batch of kmers at a time.
+// The database must have been counted with -C and the k of the hash file.
+bool count_from_jf(
+    const std::string & jffilen,
+    const std::string & outfilen,
+    HashPair hp,
+    int nh,
+    uint64_t bf_size,
+    int num_threads,
+    unsigned cutoff_count
+    ) {
+    bool adaptive = cutoff_count == CUTOFF_AUTO;
+    if (adaptive) {
+        cutoff_count = choose_cutoff(jf_histogram(jffilen));
+        std::cerr << "Chose cutoff " << cutoff_count << " for " << outfilen << std::endl;
+    }
+
+    std::ifstream in;
+    jellyfish::file_header header;
+    open_jf(jffilen, in, header);
 
-    // build the BF
     UncompressedBF bf(outfilen, hp, nh, bf_size);
+    jellyfish::binary_reader<jellyfish::mer_dna, uint64_t> reader(in, &header);
 
-    // add each kmer to the BF
-    const auto jf_ary = mer_hash.ary();
-    const auto end = jf_ary->end();
-    std::cerr << "Right before cutoff count: " << cutoff_count << std::endl;
-    for(auto kmer = jf_ary->begin(); kmer != end; ++kmer) {
-        auto& key_val = *kmer;
-        if (key_val.second >= cutoff_count) {
-            bf.add(key_val.first);
+    // at most two batches per thread are in flight at once
+    ThreadPool pool(std::max(1, num_threads));
+    std::deque<std::future<void> > pending;
+    auto add_batch = [&](std::vector<jellyfish::mer_dna> & batch) {
+        auto mers = std::make_shared<std::vector<jellyfish::mer_dna> >();
+        mers->swap(batch);
+        if (pending.size() >= 2 * std::size_t(std::max(1, num_threads))) {
+            pending.front().get();
+            pending.pop_front();
         }
+        pending.push_back(pool.submit([&, mers]() {
+            for (const auto & m : *mers) {
+                bf.add_concurrent(hash_kmer(hp, m));
+            }
+        }));
+    };
+
+    std::vector<jellyfish::mer_dna> batch;
+    uint64_t nkmers = 0, kept = 0;
+    while (reader.next()) {
+        nkmers++;
+        if (reader.val() < cutoff_count) continue;
+        kept++;
+        batch.push_back(reader.key());
+        if (batch.size() == JF_BATCH_SIZE) add_batch(batch);
+    }
+    if (!batch.empty()) add_batch(batch);
+    for (auto & f : pending) {
+        f.get();
     }
+
+    std::cerr << "Kept " << kept << " of " << nkmers << " kmers from " << jffilen << std::endl;
     bf.save();
+    if (adaptive) write_count_info(outfilen, cutoff_count, bf);
+    return true;
+}
+
+// read a list of samples to count, one per line: the input file and,
+// optionally, the filter to write (by default, the input name + .bf.bv)
+std::vector<std::pair<std::string, std::string> > read_sample_list(const std::string & list_file) {
+    std::ifstream in(list_file.c_str());
+    DIE_IF(!in, "Couldn't open sample list " + list_file);
+    std::vector<std::pair<std::string, std::string> > samples;
+    std::string line;
+    while (getline(in, line)) {
+        std::istringstream iss(line);
+        std::string infilen, outfilen;
+        if (!(iss >> infilen)) continue;
+        if (!(iss >> outfilen)) outfilen = infilen + ".bf.bv";
+        samples.emplace_back(infilen, outfilen);
+    }
+    std::cerr << "Counting " << samples.size() << " samples." << std::endl;
+    return samples;
+}
+
+// the share of the threads (1 / POPULATE_SHARE) that populates a filter
+// while the next sample is counted
+static const int POPULATE_SHARE = 4;
+
+// count every sample in the list in this one process. While one sample is
+// counted, the filter of the one before it is built from its hash on a
+// quarter of the threads, so at most two hashes are alive at once. The other
+// modes go through stream_count() or count_from_jf() one sample at a time,
+// each of them already using every thread.
+bool count_batch(
+    const std::string & list_file,
+    HashPair hp,
+    int nh,
+    uint64_t bf_size,
+    int num_threads,
+    unsigned cutoff_count,
+    CountMode mode
+    ) {
+    auto samples = read_sample_list(list_file);
+    if (mode == COUNT_STREAM) {
+        for (const auto & sample : samples) {
+            stream_count(sample.first, sample.second, hp, nh, bf_size, num_threads, cutoff_count);
+        }
+        return true;
+    }
+    if (mode == COUNT_FROM_JF) {
+        for (const auto & sample : samples) {
+            count_from_jf(sample.first, sample.second, hp, nh, bf_size, num_threads, cutoff_count);
+        }
+        return true;
+    }
+
+    // while a filter is populated alongside the next count, the threads are
+    // split between them; counting is the slower phase, so it gets most
+    int populate_threads = std::max(1, num_threads / POPULATE_SHARE);
+    int count_threads = std::max(1, num_threads - populate_threads);
+
+    std::future<void> populating;
+    for (std::size_t i = 0; i < samples.size(); i++) {
+        const auto & sample = samples[i];
+        std::cerr << "Counting " << sample.first << std::endl;
+        mer_hash_type* mer_hash = count_kmers(sample.first, populating.valid() ? count_threads : num_threads);
+
+        if (populating.valid()) populating.get();
+        std::string outfilen = sample.second;
+        int threads = (i + 1 < samples.size()) ? populate_threads : num_threads;
+        populating = std::async(std::launch::async, [=]() {
+            populate_filter(*mer_hash, outfilen, hp, nh, bf_size, threads, cutoff_count);
+            delete mer_hash;
+        });
+    }
+    if (populating.valid()) populating.get();
     return true;
 }
 
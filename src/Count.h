@@ -3,6 +3,17 @@
 
 #include "BF.h"
 #include <string>
+#include <utility>
+#include <vector>
+
+// where the counts behind a filter come from: a jellyfish hash counted
+// here, a count-min sketch filled while streaming the reads, or an existing
+// jellyfish database
+enum CountMode { COUNT_HASH, COUNT_STREAM, COUNT_FROM_JF };
+
+// a cutoff_count (--cutoff auto) asking for each sample's cutoff to be
+// chosen from its own count histogram
+const unsigned CUTOFF_AUTO = unsigned(-1);
 
 bool count(
     std::string infilen,
@@ -13,4 +24,26 @@ bool count(
     int num_threads = 16,
     unsigned cutoff_count = 3
     );
+
+bool count_from_jf(
+    const std::string & jffilen,
+    const std::string & outfilen,
+    HashPair hp,
+    int nh,
+    uint64_t bf_size,
+    int num_threads = 16,
+    unsigned cutoff_count = 3
+    );
+
+std::vector<std::pair<std::string, std::string> > read_sample_list(const std::string & list_file);
+
+bool count_batch(
+    const std::string & list_file,
+    HashPair hp,
+    int nh,
+    uint64_t bf_size,
+    int num_threads = 16,
+    unsigned cutoff_count = 3,
+    CountMode mode = COUNT_HASH
+    );
 #endif
@@ -0,0 +1,146 @@
+#include "Estimate.h"
+#include "StreamCount.h"
+#include "util.h"
+
+#include <algorithm>
+#include <cmath>
+
+double FP_RATE = 0.05;
+
+// bounds on the counters used to split kmers at the cutoff while estimating
+static const uint64_t ESTIMATE_MIN_COUNTERS = uint64_t(1) << 24;
+static const uint64_t ESTIMATE_MAX_COUNTERS = uint64_t(1) << 30;
+static const unsigned ESTIMATE_DEPTH = 4;
+
+// the expected number of kmer occurrences per counter that the sampling
+// aims for, and the load above which the split is too rough to trust
+static const double ESTIMATE_TARGET_LOAD = 0.25;
+static const double ESTIMATE_MAX_LOAD = 1.0;
+
+HyperLogLog::HyperLogLog(unsigned precision) :
+    registers(std::size_t(1) << precision, 0),
+    p(precision)
+{
+}
+
+// the first p bits pick a register, which keeps the longest run of leading
+// zeros seen in the rest
+void HyperLogLog::add(uint64_t hash) {
+    uint64_t idx = hash >> (64 - p);
+    uint64_t rest = hash << p;
+    uint8_t rank = rest ? uint8_t(__builtin_clzll(rest) + 1) : uint8_t(64 - p + 1);
+    if (rank > registers[idx]) registers[idx] = rank;
+}
+
+void HyperLogLog::merge(const HyperLogLog & other) {
+    DIE_IF(other.p != p, "Can't merge HyperLogLogs of different precision");
+    for (std::size_t i = 0; i < registers.size(); i++) {
+        registers[i] = std::max(registers[i], other.registers[i]);
+    }
+}
+
+// the harmonic mean of the registers, with linear counting for small sets
+uint64_t HyperLogLog::estimate() const {
+    double m = double(registers.size());
+    double sum = 0;
+    uint64_t zeros = 0;
+    for (uint8_t r : registers) {
+        sum += std::ldexp(1.0, -int(r));
+        if (r == 0) zeros++;
+    }
+    double alpha = 0.7213 / (1 + 1.079 / m);
+    double e = alpha * m * m / sum;
+    if (e <= 2.5 * m && zeros > 0) {
+        e = m * std::log(m / double(zeros));
+    }
+    return uint64_t(std::llround(e));
+}
+
+// stream the inputs once, counting every kmer in one HyperLogLog and the
+// kmers whose count reaches cutoff_count in another. Counting happens in a
+// count-min sketch of at most ESTIMATE_MAX_COUNTERS bytes; to keep its
+// counters from filling up on large inputs (which would make every kmer
+// look solid), only a 1/2^s slice of the hash space is counted, with s
+// chosen from the input size, and the solid estimate is scaled back up. The
+// split is slightly generous: a kmer can be counted as solid a little early,
+// never late.
+KmerEstimate estimate_kmers(
+    const std::vector<std::string> & files,
+    HashPair hp,
+    unsigned cutoff_count,
+    int num_threads
+    ) {
+    num_threads = std::max(1, num_threads);
+    DIE_IF(cutoff_count > CountMin::MAX_COUNT, "Estimated counts stop at "
+        + std::to_string(CountMin::MAX_COUNT) + "; use a lower cutoff");
+
+    // roughly one kmer occurrence per base; gzipped input is about 4x smaller
+    uint64_t bases = 0;
+    for (const auto & f : files) {
+        bool gz = f.size() > 3 && f.substr(f.size() - 3) == ".gz";
+        bases += file_size(f) * (gz ? 4 : 1);
+    }
+    uint64_t nb_counters = cutoff_count > 1
+        ? std::min(ESTIMATE_MAX_COUNTERS, std::max(ESTIMATE_MIN_COUNTERS, bases))
+        : 0;
+    CountMin counts(nb_counters, ESTIMATE_DEPTH);
+    double width = double(std::max<uint64_t>(1, nb_counters / ESTIMATE_DEPTH));
+
+    unsigned shift = 0;
+    while (shift < 32 && double(bases >> shift) > ESTIMATE_TARGET_LOAD * width) shift++;
+    uint64_t slice_mask = (uint64_t(1) << shift) - 1;
+    if (cutoff_count > 1 && shift > 0) {
+        std::cerr << "Counting 1/" << (slice_mask + 1) << " of the kmers to split at the cutoff" << std::endl;
+    }
+
+    // one pair of HyperLogLogs per thread, merged at the end
+    std::vector<HyperLogLog> distinct(num_threads), solid(num_threads);
+    std::vector<uint64_t> counted(num_threads, 0);
+    for (const auto & f : files) {
+        std::cerr << "Estimating kmers in " << f << std::endl;
+        stream_kmers(f, num_threads, [&](int t, const jellyfish::mer_dna & m) {
+            KmerHash h = hash_kmer(hp, m);
+            uint64_t x = mix64(h.first ^ mix64(h.second));
+            distinct[t].add(x);
+            if (cutoff_count <= 1) {
+                solid[t].add(x);
+            } else if ((mix64(x + 0x9e3779b97f4a7c15ULL) & slice_mask) == 0) {
+                counted[t]++;
+                if (counts.increment(h) >= cutoff_count) solid[t].add(x);
+            }
+        });
+    }
+    uint64_t total_counted = 0;
+    for (int t = 0; t < num_threads; t++) {
+        total_counted += counted[t];
+        if (t == 0) continue;
+        distinct[0].merge(distinct[t]);
+        solid[0].merge(solid[t]);
+    }
+    double load = double(total_counted) / width;
+    if (cutoff_count > 1 && load > ESTIMATE_MAX_LOAD) {
+        WARN("Count-min load is " + std::to_string(load)
+            + " per counter; kmers below the cutoff may be counted as solid");
+    }
+
+    KmerEstimate est;
+    est.distinct = distinct[0].estimate();
+    est.solid = std::min(est.distinct, solid[0].estimate() << shift);
+    return est;
+}
+
+// the number of hashes that minimizes the size of a filter for fp_rate
+int optimal_nb_hashes(double fp_rate) {
+    return std::max(1, int(std::lround(-std::log2(fp_rate))));
+}
+
+// the smallest filter (rounded up to a whole word) that holds nb_kmers with
+// nh hashes at a false positive rate of at most fp_rate:
+// fp = (1 - e^(-nh n / m))^nh, solved for m
+uint64_t filter_size_for(uint64_t nb_kmers, int nh, double fp_rate) {
+    DIE_IF(fp_rate <= 0 || fp_rate >= 1, "False positive rate must be in (0, 1)");
+    double fill = std::pow(fp_rate, 1.0 / nh);
+    double m = -double(nh) * double(std::max<uint64_t>(1, nb_kmers)) / std::log1p(-fill);
+    uint64_t bits = uint64_t(std::ceil(m));
+    return std::max<uint64_t>(64, (bits + 63) / 64 * 64);
+}
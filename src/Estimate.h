@@ -0,0 +1,45 @@
+#ifndef ESTIMATE_H
+#define ESTIMATE_H
+
+#include "BF.h"
+#include <cstdint>
+#include <string>
+#include <vector>
+
+// target false positive rate of one filter, used to size filters
+extern double FP_RATE;
+
+// a HyperLogLog distinct counter: 2^precision one-byte registers estimate
+// the number of distinct 64-bit hashes added, within about
+// 1.04 / sqrt(2^precision) (0.8% at the default precision).
+class HyperLogLog {
+public:
+    HyperLogLog(unsigned precision = 14);
+
+    void add(uint64_t hash);
+    void merge(const HyperLogLog & other);
+    uint64_t estimate() const;
+
+private:
+    std::vector<uint8_t> registers;
+    unsigned p;
+};
+
+// distinct kmers in a set of inputs, and how many of them were seen at
+// least cutoff_count times (and so would be added to a filter)
+struct KmerEstimate {
+    uint64_t distinct;
+    uint64_t solid;
+};
+
+KmerEstimate estimate_kmers(
+    const std::vector<std::string> & files,
+    HashPair hp,
+    unsigned cutoff_count,
+    int num_threads = 16
+    );
+
+int optimal_nb_hashes(double fp_rate);
+uint64_t filter_size_for(uint64_t nb_kmers, int nh, double fp_rate);
+
+#endif
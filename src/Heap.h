@@ -59,6 +59,21 @@ public:
         return siftup(heap.size()-1);
     }
 
+    // remove an item from anywhere in the heap
+    void remove(heap_reference* n) {
+        assert(heap[n->pos] == n);
+        int hole = n->pos;
+        auto last = heap.back();
+        heap.pop_back();
+        if (last != n) {
+            heap[hole] = last;
+            last->pos = hole;
+            siftup(hole);
+            siftdown(last->pos);
+        }
+        delete n;
+    }
+
     heap_reference* increase_key(heap_reference* n, int new_key) {
         assert(heap[n->pos] == n);
         heap[n->pos]->key = new_key;
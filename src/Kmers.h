@@ -10,4 +10,31 @@
 //Kmer kmer_to_bits(const std::string & str);
 std::set<jellyfish::mer_dna> kmers_in_string(const std::string & str);
 
+inline bool is_base(char c) {
+    switch (c) {
+    case 'A': case 'C': case 'G': case 'T':
+    case 'a': case 'c': case 'g': case 't':
+        return true;
+    default:
+        return false;
+    }
+}
+
+// call f(mer) for each kmer of str, in order, skipping those that contain
+// anything but ACGT. Each kmer is rolled from the previous one.
+template <typename F>
+void for_each_kmer(const std::string & str, F f) {
+    const unsigned k = jellyfish::mer_dna::k();
+    jellyfish::mer_dna m;
+    unsigned valid = 0;
+    for (char c : str) {
+        if (!is_base(c)) {
+            valid = 0;
+            continue;
+        }
+        m.shift_left(c);
+        if (++valid >= k) f(m);
+    }
+}
+
 #endif
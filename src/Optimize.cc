@@ -0,0 +1,191 @@
+#include "Optimize.h"
+#include "Build.h"
+#include "BloomTree.h"
+#include "Sketch.h"
+#include "util.h"
+
+#include <map>
+#include <set>
+
+/* The cost of a tree is the sum, over its unions, of the number of set bits
+ * in the union, estimated from the sketches. A query kmer passes a filter
+ * with probability about equal to its fill, so a query drops out of a
+ * subtree that doesn't contain it sooner when that subtree's unions are
+ * small, and it visits fewer nodes. The restructurings below never change
+ * the union at the node where they are applied, only the unions of the
+ * children they regroup, so they can be judged locally.
+ */
+
+// a change must lower the cost of the unions it touches by this fraction;
+// smaller gains are within the error of the sketches
+static const double OPTIMIZE_MIN_GAIN = 0.02;
+
+// the number of times the whole tree is revisited
+static const int OPTIMIZE_MAX_PASSES = 4;
+
+namespace {
+
+bool is_union(const BloomTree* T) {
+    return T != nullptr && T->num_children() == 2;
+}
+
+class Optimizer {
+public:
+    std::set<BloomTree*> changed;
+    std::size_t moves = 0;
+
+    double tree_cost(const BloomTree* T) const {
+        if (T->num_children() == 0) return 0;
+        double c = sketch_of(T).cardinality();
+        for (int i = 0; i < 2; i++) {
+            if (T->child(i) != nullptr) c += tree_cost(T->child(i));
+        }
+        return c;
+    }
+
+    // optimize the subtrees, then T; returns the number of changes made
+    std::size_t pass(BloomTree* T) {
+        if (T->num_children() == 0) return 0;
+        std::size_t before = moves;
+        for (int i = 0; i < 2; i++) {
+            if (T->child(i) != nullptr) pass(T->child(i));
+        }
+        while (swap_grandchildren(T) || rotate(T)) { }
+        return moves - before;
+    }
+
+private:
+    // the sketches of the regrouped unions. They are kept here rather than
+    // in the nodes, which would save them over the input tree's sketches.
+    std::map<const BloomTree*, Sketch> planned;
+
+    const Sketch & sketch_of(const BloomTree* T) const {
+        auto it = planned.find(T);
+        return it != planned.end() ? it->second : T->sketch();
+    }
+
+    Sketch union_sketch(const BloomTree* a, const BloomTree* b) const {
+        Sketch u(sketch_of(a));
+        u.merge(sketch_of(b));
+        return u;
+    }
+
+    // make U the union of a and b
+    void regroup(BloomTree* U, BloomTree* a, BloomTree* b, const Sketch & s) {
+        U->set_child(0, a);
+        U->set_child(1, b);
+        planned[U] = s;
+        changed.insert(U);
+    }
+
+    // T = (L, R(r0, r1)): if L is closer to one of r0 and r1 than they are
+    // to each other, make R the union of L and that one, and move the
+    // other up to be R's sibling
+    bool rotate(BloomTree* T) {
+        if (T->num_children() != 2) return false;
+        for (int side = 0; side < 2; side++) {
+            BloomTree* R = T->child(side);
+            BloomTree* L = T->child(1 - side);
+            if (!is_union(R)) continue;
+
+            double current = sketch_of(R).cardinality();
+            int best = -1;
+            double best_cost = current * (1 - OPTIMIZE_MIN_GAIN);
+            Sketch best_sketch;
+            for (int k = 0; k < 2; k++) {
+                Sketch s = union_sketch(L, R->child(k));
+                if (s.cardinality() < best_cost) {
+                    best_cost = s.cardinality();
+                    best = k;
+                    best_sketch = s;
+                }
+            }
+            if (best == -1) continue;
+
+            BloomTree* keep = R->child(best);
+            BloomTree* up = R->child(1 - best);
+            std::cerr << "Rotating " << up->name() << " above " << R->name() << std::endl;
+            regroup(R, L, keep, best_sketch);
+            T->set_child(1 - side, up);
+            moves++;
+            return true;
+        }
+        return false;
+    }
+
+    // T = (A(a0, a1), B(b0, b1)): try the two other ways of pairing the
+    // four grandchildren
+    bool swap_grandchildren(BloomTree* T) {
+        BloomTree* A = T->child(0);
+        BloomTree* B = T->child(1);
+        if (!is_union(A) || !is_union(B)) return false;
+
+        BloomTree* a0 = A->child(0);
+        BloomTree* a1 = A->child(1);
+        double current = sketch_of(A).cardinality() + sketch_of(B).cardinality();
+        double best_cost = current * (1 - OPTIMIZE_MIN_GAIN);
+        int best = -1;
+        Sketch best_a, best_b;
+        for (int k = 0; k < 2; k++) {
+            Sketch sa = union_sketch(a0, B->child(k));
+            Sketch sb = union_sketch(a1, B->child(1 - k));
+            double c = sa.cardinality() + sb.cardinality();
+            if (c < best_cost) {
+                best_cost = c;
+                best = k;
+                best_a = sa;
+                best_b = sb;
+            }
+        }
+        if (best == -1) return false;
+
+        BloomTree* b0 = B->child(best);
+        BloomTree* b1 = B->child(1 - best);
+        std::cerr << "Swapping " << a1->name() << " and " << b0->name() << std::endl;
+        regroup(A, a0, b0, best_a);
+        regroup(B, a1, b1, best_b);
+        moves++;
+        return true;
+    }
+};
+
+// rebuild the changed unions, children before parents, writing each to a
+// new file named after outf so the input tree stays valid
+void rebuild(BloomTree* T, const std::set<BloomTree*> & changed, const std::string & outf, std::size_t & next) {
+    for (int i = 0; i < 2; i++) {
+        if (T->child(i) != nullptr) rebuild(T->child(i), changed, outf, next);
+    }
+    if (changed.count(T) != 0) {
+        std::string fn = outf + "_opt" + std::to_string(next++) + ".bf.bv";
+        std::cerr << "Recomputing " << T->name() << " as " << fn << std::endl;
+        T->recompute_union(fn);
+    }
+}
+
+} // namespace
+
+// restructure an (uncompressed) tree to lower its cost, by rotations and by
+// swapping grandchildren between siblings, and write it to outf. Only the
+// unions whose children changed are recomputed; they are written to new
+// files, and the input tree and its filters are left as they were.
+void optimize_tree(const std::string & tree_file, const std::string & outf) {
+    std::string hashes_file = read_tree_hash_file(tree_file);
+    BloomTree* root = read_bloom_tree(tree_file);
+    DIE_IF(root->name().substr(root->name().size() - 3) != ".bv",
+        "Can only optimize an uncompressed tree.");
+
+    Optimizer opt;
+    double before = opt.tree_cost(root);
+    for (int p = 0; p < OPTIMIZE_MAX_PASSES; p++) {
+        std::size_t n = opt.pass(root);
+        std::cerr << "Pass " << p << ": " << n << " changes" << std::endl;
+        if (n == 0) break;
+    }
+    double after = opt.tree_cost(root);
+    std::cerr << "Estimated cost " << before << " -> " << after << " ("
+        << opt.changed.size() << " unions to recompute)" << std::endl;
+
+    std::size_t next = 0;
+    rebuild(root, opt.changed, outf, next);
+    save_bloom_tree(root, outf, hashes_file);
+}
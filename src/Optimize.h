@@ -0,0 +1,8 @@
+#ifndef OPTIMIZE_H
+#define OPTIMIZE_H
+
+#include <string>
+
+void optimize_tree(const std::string & tree_file, const std::string & outf);
+
+#endif
@@ -0,0 +1,153 @@
+#include "PerfCounters.h"
+#include "BloomTree.h"
+#include "util.h"
+
+#include <cerrno>
+#include <cstring>
+#include <map>
+#include <mutex>
+#include <utility>
+#include <vector>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+
+bool PERF_ENABLED = false;
+
+static const int PERF_NB_EVENTS = 4;
+static const char* PERF_EVENT_NAMES[PERF_NB_EVENTS] = {
+    "cycles", "instructions", "llc-misses", "branch-misses"
+};
+static const uint64_t PERF_EVENT_CONFIGS[PERF_NB_EVENTS] = {
+    PERF_COUNT_HW_CPU_CYCLES,
+    PERF_COUNT_HW_INSTRUCTIONS,
+    PERF_COUNT_HW_CACHE_MISSES,
+    PERF_COUNT_HW_BRANCH_MISSES
+};
+static const char* PERF_PHASE_NAMES[PERF_NB_PHASES] = {
+    "hash", "probe", "load", "union", "similarity", "compress"
+};
+
+namespace {
+
+struct PerfTotals {
+    uint64_t calls = 0;
+    uint64_t events[PERF_NB_EVENTS] = {0, 0, 0, 0};
+};
+
+// the totals, by (phase, level)
+std::mutex totals_lock;
+std::map<std::pair<int, int>, PerfTotals> totals;
+
+// counters are per thread: each thread opens its own event group the first
+// time it enters a scope
+struct ThreadCounters {
+    int fds[PERF_NB_EVENTS] = {-1, -1, -1, -1};
+    bool opened = false;
+    uint64_t last[PERF_NB_EVENTS] = {0, 0, 0, 0};
+    std::vector<std::pair<int, int> > stack;  // active (phase, level) scopes
+
+    ~ThreadCounters() {
+        for (int fd : fds) if (fd != -1) close(fd);
+    }
+};
+thread_local ThreadCounters tc;
+
+int open_event(uint64_t config, int group_fd) {
+    struct perf_event_attr attr;
+    std::memset(&attr, 0, sizeof(attr));
+    attr.size = sizeof(attr);
+    attr.type = PERF_TYPE_HARDWARE;
+    attr.config = config;
+    attr.disabled = (group_fd == -1) ? 1 : 0;
+    attr.exclude_kernel = 1;
+    attr.exclude_hv = 1;
+    return int(syscall(__NR_perf_event_open, &attr, 0, -1, group_fd, 0));
+}
+
+// open the calling thread's counters; events the hardware doesn't support
+// are left closed and read as 0
+bool open_thread_counters() {
+    tc.opened = true;
+    tc.fds[0] = open_event(PERF_EVENT_CONFIGS[0], -1);
+    if (tc.fds[0] == -1) return false;
+    for (int e = 1; e < PERF_NB_EVENTS; e++) {
+        tc.fds[e] = open_event(PERF_EVENT_CONFIGS[e], tc.fds[0]);
+    }
+    ioctl(tc.fds[0], PERF_EVENT_IOC_RESET, 0);
+    ioctl(tc.fds[0], PERF_EVENT_IOC_ENABLE, 0);
+    return true;
+}
+
+void read_counters(uint64_t * out) {
+    for (int e = 0; e < PERF_NB_EVENTS; e++) {
+        uint64_t v = 0;
+        if (tc.fds[e] != -1 && read(tc.fds[e], &v, sizeof(v)) != sizeof(v)) v = 0;
+        out[e] = v;
+    }
+}
+
+// charge the events since the last reading to the innermost active scope
+void charge(bool new_call) {
+    uint64_t now[PERF_NB_EVENTS];
+    read_counters(now);
+    if (!tc.stack.empty()) {
+        std::lock_guard<std::mutex> g(totals_lock);
+        PerfTotals & t = totals[tc.stack.back()];
+        for (int e = 0; e < PERF_NB_EVENTS; e++) t.events[e] += now[e] - tc.last[e];
+        if (new_call) t.calls++;
+    }
+    std::memcpy(tc.last, now, sizeof(now));
+}
+
+} // namespace
+
+// check that counters can be opened here; if not, warn and leave profiling
+// disabled
+bool perf_init() {
+    int fd = open_event(PERF_EVENT_CONFIGS[0], -1);
+    if (fd == -1) {
+        WARN(std::string("hardware performance counters unavailable (") + strerror(errno)
+            + "); --perf-counters ignored. Check /proc/sys/kernel/perf_event_paranoid.");
+        PERF_ENABLED = false;
+        return false;
+    }
+    close(fd);
+    PERF_ENABLED = true;
+    return true;
+}
+
+void PerfScope::start(PerfPhase phase, const BloomTree* node) {
+    if (!tc.opened && !open_thread_counters()) {
+        active = false;
+        return;
+    }
+    if (tc.fds[0] == -1) {
+        active = false;
+        return;
+    }
+    charge(false);
+    tc.stack.emplace_back(int(phase), (node == nullptr) ? -1 : node->depth());
+}
+
+void PerfScope::stop() {
+    charge(true);
+    tc.stack.pop_back();
+}
+
+// print a table of events by phase and tree level
+void perf_report(std::ostream & out) {
+    std::lock_guard<std::mutex> g(totals_lock);
+    out << "phase\tlevel\tcalls";
+    for (int e = 0; e < PERF_NB_EVENTS; e++) out << "\t" << PERF_EVENT_NAMES[e];
+    out << "\tIPC" << std::endl;
+    for (const auto & p : totals) {
+        const PerfTotals & t = p.second;
+        out << PERF_PHASE_NAMES[p.first.first] << "\t";
+        if (p.first.second < 0) out << "-"; else out << p.first.second;
+        out << "\t" << t.calls;
+        for (int e = 0; e < PERF_NB_EVENTS; e++) out << "\t" << t.events[e];
+        out << "\t" << (t.events[0] ? double(t.events[1]) / t.events[0] : 0) << std::endl;
+    }
+}
@@ -0,0 +1,42 @@
+#ifndef PERFCOUNTERS_H
+#define PERFCOUNTERS_H
+
+#include <iostream>
+
+class BloomTree;
+
+enum PerfPhase {
+    PERF_HASH,
+    PERF_PROBE,
+    PERF_LOAD,
+    PERF_UNION,
+    PERF_SIMILARITY,
+    PERF_COMPRESS,
+    PERF_NB_PHASES
+};
+
+// true once perf_init() has succeeded; PerfScopes do nothing otherwise
+extern bool PERF_ENABLED;
+
+bool perf_init();
+void perf_report(std::ostream & out);
+
+// counts hardware events (cycles, instructions, LLC misses, branch misses)
+// from construction to destruction and charges them to a phase and tree
+// level (the depth of node, or -1 if there is no node). Scopes may nest;
+// events are charged only to the innermost active scope.
+class PerfScope {
+public:
+    PerfScope(PerfPhase phase, const BloomTree* node = nullptr) : active(PERF_ENABLED) {
+        if (active) start(phase, node);
+    }
+    ~PerfScope() {
+        if (active) stop();
+    }
+private:
+    void start(PerfPhase phase, const BloomTree* node);
+    void stop();
+    bool active;
+};
+
+#endif
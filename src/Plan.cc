@@ -0,0 +1,277 @@
+#include "Plan.h"
+#include "Query.h"
+#include "util.h"
+
+#include <cmath>
+#include <fstream>
+#include <sstream>
+#include <unordered_map>
+#include <vector>
+#include <sys/stat.h>
+
+/* The cost model.
+   
+   Visiting a node costs a load (unless the filter is already in the cache)
+   plus one probe per hash application per kmer per query that reaches it. A
+   query reaches a node if it passed the node's parent. It passes a node
+   either because some leaf below truly contains it (we assume each leaf
+   matches a random query with probability PLAN_MATCH_RATE) or by chance,
+   which for a filter with fill ratio f and h hashes happens per kmer with
+   probability f^h.
+
+   Scanning leaves reads them sequentially, without seeks, and probes every
+   query against every leaf.
+
+   The constants are rough figures for a spinning disk / network filesystem
+   and should be treated as relative weights.
+*/
+static const double PLAN_LOAD_BANDWIDTH = 200.0e6;  // bytes per second
+static const double PLAN_SEEK_TIME = 5.0e-3;        // seconds per random load
+static const double PLAN_SCAN_BANDWIDTH = 400.0e6;  // bytes per second
+static const double PLAN_PROBE_BV = 50.0e-9;        // seconds per bit test
+static const double PLAN_PROBE_RRR = 400.0e-9;      // seconds per bit test
+static const double PLAN_MATCH_RATE = 0.01;
+
+namespace {
+
+struct PlanContext {
+    const NodeStatsMap & stats;
+    double batch;
+    double kmers;
+    int num_hash;
+    std::unordered_map<const BloomTree*, int> leaves;  // leaves below each node
+    std::vector<const BloomTree*> scan_below;
+};
+
+const NodeStats & stats_for(const PlanContext & ctx, const BloomTree* node) {
+    auto it = ctx.stats.find(node->name());
+    DIE_IF(it == ctx.stats.end(), "No statistics for node " + node->name());
+    return it->second;
+}
+
+int count_leaves(const BloomTree* node) {
+    if (node == nullptr) return 0;
+    if (node->num_children() == 0) return 1;
+    return count_leaves(node->child(0)) + count_leaves(node->child(1));
+}
+
+// record the number of leaves below every node, in one pass
+int index_leaves(PlanContext & ctx, const BloomTree* node) {
+    if (node == nullptr) return 0;
+    int n = (node->num_children() == 0) ? 1
+        : index_leaves(ctx, node->child(0)) + index_leaves(ctx, node->child(1));
+    ctx.leaves[node] = n;
+    return n;
+}
+
+// Chernoff bound on P[Binomial(n, p) >= t*n]; exact when t >= 1
+double binomial_tail(double n, double p, double t) {
+    if (p >= t) return 1.0;
+    if (p <= 0) return 0.0;
+    if (t >= 1) return std::pow(p, n);
+    double kl = t * std::log(t / p) + (1 - t) * std::log((1 - t) / (1 - p));
+    return std::exp(-n * kl);
+}
+
+// probability that a random query passes this node
+double pass_probability(const PlanContext & ctx, const BloomTree* node) {
+    const NodeStats & s = stats_for(ctx, node);
+    double fill = (s.bits > 0) ? double(s.ones) / s.bits : 1.0;
+    double p_kmer = std::pow(fill, ctx.num_hash);
+    double p_chance = binomial_tail(ctx.kmers, p_kmer, QUERY_THRESHOLD);
+    double p_true = 1.0 - std::pow(1.0 - PLAN_MATCH_RATE, ctx.leaves.at(node));
+    return 1.0 - (1.0 - p_true) * (1.0 - p_chance);
+}
+
+double probe_time(const BloomTree* node) {
+    const std::string & n = node->name();
+    bool rrr = n.size() >= 4 && n.substr(n.size() - 4) == ".rrr";
+    return rrr ? PLAN_PROBE_RRR : PLAN_PROBE_BV;
+}
+
+// probability that a node expected to be reached by `queries` queries of the
+// batch is reached by at least one, and so has to be loaded
+double load_probability(const PlanContext & ctx, double queries) {
+    return 1.0 - std::pow(1.0 - std::min(1.0, queries / ctx.batch), ctx.batch);
+}
+
+// time to read the node's filter, if it isn't in memory
+double load_time(const PlanContext & ctx, const BloomTree* node, bool sequential) {
+    if (node->is_loaded()) return 0;
+    const NodeStats & s = stats_for(ctx, node);
+    return sequential
+        ? s.file_bytes / PLAN_SCAN_BANDWIDTH
+        : PLAN_SEEK_TIME + s.file_bytes / PLAN_LOAD_BANDWIDTH;
+}
+
+// cost to test `queries` queries against this node, loading it if needed
+double visit_cost(const PlanContext & ctx, const BloomTree* node, double queries, bool sequential) {
+    return load_probability(ctx, queries) * load_time(ctx, node, sequential)
+        + queries * ctx.kmers * ctx.num_hash * probe_time(node);
+}
+
+// the leaf totals a scan's cost is made of, so it can be priced for any
+// number of queries without walking the leaves again
+struct ScanTerms {
+    double load = 0;    // reading every unloaded leaf in sequence
+    double probe = 0;   // one probe of every leaf
+};
+
+void add_leaf(const PlanContext & ctx, const BloomTree* leaf, ScanTerms & t) {
+    t.load += load_time(ctx, leaf, true);
+    t.probe += probe_time(leaf);
+}
+
+// every leaf gets the same queries, so this is the sum of their visit_cost()s
+double scan_cost(const PlanContext & ctx, const ScanTerms & t, double queries) {
+    return load_probability(ctx, queries) * t.load
+        + queries * ctx.kmers * ctx.num_hash * t.probe;
+}
+
+// cost of walking the subtree at node, never switching to a scan
+double traverse_cost(const PlanContext & ctx, const BloomTree* node, double queries) {
+    if (node == nullptr) return 0;
+    double c = visit_cost(ctx, node, queries, false);
+    double passing = queries * pass_probability(ctx, node);
+    return c + traverse_cost(ctx, node->child(0), passing)
+             + traverse_cost(ctx, node->child(1), passing);
+}
+
+// cost of the cheapest mix of walking and scanning for the subtree at node;
+// nodes below which scanning wins are added to ctx.scan_below. The scan terms
+// of the subtree's leaves are added to scan in the same pass.
+double hybrid_cost(PlanContext & ctx, const BloomTree* node, double queries, ScanTerms & scan) {
+    if (node == nullptr) return 0;
+    double c = visit_cost(ctx, node, queries, false);
+    if (node->num_children() == 0) {
+        add_leaf(ctx, node, scan);
+        return c;
+    }
+
+    // the children's choices are appended after this point, and dropped if
+    // the whole subtree is scanned instead
+    double passing = queries * pass_probability(ctx, node);
+    std::size_t saved = ctx.scan_below.size();
+    ScanTerms below;
+    double walk = hybrid_cost(ctx, node->child(0), passing, below)
+                + hybrid_cost(ctx, node->child(1), passing, below);
+    scan.load += below.load;
+    scan.probe += below.probe;
+
+    double scanned = scan_cost(ctx, below, passing);
+    if (scanned < walk) {
+        ctx.scan_below.resize(saved);
+        ctx.scan_below.push_back(node);
+        return c + scanned;
+    }
+    return c + walk;
+}
+
+void collect_nodes(BloomTree* node, std::vector<BloomTree*> & out) {
+    if (node == nullptr) return;
+    out.push_back(node);
+    collect_nodes(node->child(0), out);
+    collect_nodes(node->child(1), out);
+}
+
+} // namespace
+
+// read the per-node statistics cached in tree_file.stats, computing (and
+// caching) those that are missing or older than the tree file. Computing
+// statistics for a node requires loading its filter once.
+NodeStatsMap load_node_stats(BloomTree* root, const std::string & tree_file) {
+    std::string stats_file = tree_file + ".stats";
+    NodeStatsMap stats;
+
+    if (file_mtime(stats_file) >= file_mtime(tree_file)) {
+        std::ifstream in(stats_file);
+        std::string line;
+        while (getline(in, line)) {
+            std::istringstream iss(line);
+            std::string name;
+            NodeStats s;
+            if (iss >> name >> s.bits >> s.ones >> s.file_bytes) {
+                stats[name] = s;
+            }
+        }
+    }
+
+    std::vector<BloomTree*> nodes;
+    collect_nodes(root, nodes);
+    std::size_t computed = 0;
+    for (auto & n : nodes) {
+        if (stats.count(n->name())) continue;
+        struct stat buf;
+        DIE_IF(stat(n->name().c_str(), &buf) == -1, "Can't stat " + n->name());
+        NodeStats s;
+        s.bits = n->bf()->size();
+        s.ones = n->bf()->count_ones();
+        s.file_bytes = buf.st_size;
+        stats[n->name()] = s;
+        computed++;
+    }
+
+    if (computed > 0) {
+        std::cerr << "Computed statistics for " << computed << " nodes; saving to "
+            << stats_file << std::endl;
+        std::ofstream out(stats_file);
+        for (const auto & p : stats) {
+            out << p.first << " " << p.second.bits << " " << p.second.ones
+                << " " << p.second.file_bytes << std::endl;
+        }
+    }
+    return stats;
+}
+
+// predict the cost of each strategy for a batch of batch_size queries with
+// avg_kmers kmers each, and pick the cheapest.
+QueryPlan plan_query(
+    BloomTree* root,
+    const NodeStatsMap & stats,
+    std::size_t batch_size,
+    double avg_kmers
+) {
+    PlanContext ctx{stats, double(std::max<std::size_t>(batch_size, 1)), avg_kmers,
+        root->num_hashes(), {}, {}};
+    index_leaves(ctx, root);
+
+    QueryPlan plan;
+    plan.batch_size = batch_size;
+    plan.avg_kmers = avg_kmers;
+    plan.cost[PLAN_TRAVERSE] = traverse_cost(ctx, root, ctx.batch);
+    ScanTerms scan;
+    plan.cost[PLAN_HYBRID] = hybrid_cost(ctx, root, ctx.batch, scan);
+    plan.cost[PLAN_SCAN] = scan_cost(ctx, scan, ctx.batch);
+    plan.scan_below.insert(ctx.scan_below.begin(), ctx.scan_below.end());
+
+    // a hybrid that never scans is just a traversal, and one that scans from
+    // the root is (nearly) a leaf scan
+    if (plan.scan_below.empty()) plan.cost[PLAN_HYBRID] = plan.cost[PLAN_TRAVERSE];
+
+    plan.type = PLAN_TRAVERSE;
+    if (plan.cost[PLAN_SCAN] < plan.cost[plan.type]) plan.type = PLAN_SCAN;
+    if (!plan.scan_below.empty() && plan.cost[PLAN_HYBRID] < plan.cost[plan.type]) {
+        plan.type = PLAN_HYBRID;
+    }
+    return plan;
+}
+
+void explain_plan(const QueryPlan & plan, std::ostream & out) {
+    const char* names[] = {"traverse", "leaf-scan", "hybrid"};
+    out << "Plan for " << plan.batch_size << " queries of ~" << plan.avg_kmers
+        << " kmers at threshold " << QUERY_THRESHOLD << ":" << std::endl;
+    for (int t = 0; t < 3; t++) {
+        out << "    " << names[t] << " predicted cost " << plan.cost[t] << " s";
+        if (t == PLAN_HYBRID) {
+            out << " (scan below " << plan.scan_below.size() << " nodes)";
+        }
+        out << std::endl;
+    }
+    out << "Chosen: " << names[plan.type] << std::endl;
+    if (plan.type == PLAN_HYBRID) {
+        for (const auto & n : plan.scan_below) {
+            out << "    scan below " << n->name() << " ("
+                << count_leaves(n) << " leaves)" << std::endl;
+        }
+    }
+}
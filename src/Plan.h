@@ -0,0 +1,40 @@
+#ifndef PLAN_H
+#define PLAN_H
+
+#include <map>
+#include <set>
+#include <string>
+#include <iostream>
+#include "BloomTree.h"
+
+// per-node statistics used by the planner
+struct NodeStats {
+    uint64_t bits;        // size of the filter
+    uint64_t ones;        // number of set bits
+    uint64_t file_bytes;  // size of the filter on disk
+};
+
+using NodeStatsMap = std::map<std::string, NodeStats>;
+
+enum PlanType { PLAN_TRAVERSE = 0, PLAN_SCAN = 1, PLAN_HYBRID = 2 };
+
+// a plan for executing one batch of queries: walk the tree, scan every leaf,
+// or walk the tree but scan all leaves below the nodes in scan_below.
+struct QueryPlan {
+    PlanType type;
+    double cost[3];             // predicted cost (seconds) of each PlanType
+    std::set<const BloomTree*> scan_below;
+    std::size_t batch_size;
+    double avg_kmers;
+};
+
+NodeStatsMap load_node_stats(BloomTree* root, const std::string & tree_file);
+QueryPlan plan_query(
+    BloomTree* root,
+    const NodeStatsMap & stats,
+    std::size_t batch_size,
+    double avg_kmers
+);
+void explain_plan(const QueryPlan & plan, std::ostream & out);
+
+#endif
@@ -1,9 +1,32 @@
 #include "Query.h"
 #include "Kmers.h"
 #include "util.h"
+#include "SeqReader.h"
+#include "Plan.h"
+#include "Trace.h"
+#include "Replay.h"
+#include "PerfCounters.h"
+#include "ThreadPool.h"
 #include <cassert>
+#include <cstring>
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <future>
+#include <mutex>
+#include <thread>
+#include <tuple>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/stat.h>
+#include <linux/fs.h>
+#include <linux/fiemap.h>
 
 float QUERY_THRESHOLD = 0.9;
+uint64_t COMPRESS_MEMORY = uint64_t(4) << 30;
+std::size_t QUERY_WINDOW = 100000;
+unsigned QUERY_THREADS = 16;
 
 // ** THIS IS NOW PARTIALLY DEPRICATED. ONLY WORKS WITH HARDCODED SIMILARITY TYPE
 void assert_is_union(BloomTree* u) {
@@ -62,16 +85,58 @@ void draw_bt(BloomTree* root, std::string outfile) {
     out << "}" << std::endl;
 }
 
-void compress_bt(BloomTree* root) {
-	if (root == nullptr) return;
-
-	root->bf()->compress();
-
-	if (root->child(0)) {
-		compress_bt(root->child(0));
+// write the .rrr compressed copy of every uncompressed filter in the tree
+// whose copy is missing or not strictly newer than the filter. nb_threads workers each
+// read, compress and write one filter at a time, so the stages overlap across
+// filters; a worker only starts on a filter once the filters in flight (about
+// twice their file size each, for the bit vector and the RRR vector being
+// built) fit in COMPRESS_MEMORY.
+void compress_bt(BloomTree* root, unsigned nb_threads) {
+	std::vector<const BloomTree*> nodes;
+	std::vector<const BloomTree*> stack = {root};
+	while (!stack.empty()) {
+		const BloomTree* node = stack.back();
+		stack.pop_back();
+		if (node == nullptr) continue;
+		stack.push_back(node->child(1));
+		stack.push_back(node->child(0));
+
+		const std::string fn = node->name();
+		if (fn.size() < 3 || fn.substr(fn.size() - 3) != ".bv") continue;
+		if (file_newer(fn + ".rrr", fn)) {
+			std::cerr << "Skipping " << fn << ": already compressed." << std::endl;
+			continue;
+		}
+		nodes.push_back(node);
 	}
-	if (root->child(1)){
-		compress_bt(root->child(1));
+	std::cerr << "Compressing " << nodes.size() << " filters." << std::endl;
+
+	std::mutex lock;
+	std::condition_variable freed;
+	uint64_t in_use = 0;
+	std::vector<std::future<void> > done;
+	ThreadPool pool(nb_threads);
+	for (const BloomTree* node : nodes) {
+		done.push_back(pool.submit([&, node]() {
+			uint64_t need = 2 * file_size(node->name());
+			{
+				std::unique_lock<std::mutex> g(lock);
+				freed.wait(g, [&]() { return in_use == 0 || in_use + need <= COMPRESS_MEMORY; });
+				in_use += need;
+			}
+			{
+				PerfScope perf(PERF_COMPRESS, node);
+				compress_filter_file(node->name());
+			}
+			{
+				std::lock_guard<std::mutex> g(lock);
+				in_use -= need;
+			}
+			freed.notify_all();
+		}));
+	}
+	for (auto & f : done) {
+		f.get();
 	}
 }
 
@@ -87,18 +152,37 @@ bool query_passes(BloomTree* root, const std::set<jellyfish::mer_dna> & q) {
 }
 
 
-// return true if the filter at this node contains > QUERY_THRESHOLD kmers
-bool query_passes(BloomTree* root, QueryInfo*  q) {//const std::set<jellyfish::mer_dna> & q) {
+// compute the hashes of the query's kmers; every filter in the tree shares
+// the same HashPair, so this only has to be done once per query.
+void hash_query(const BloomTree* root, QueryInfo* q) {
+    PerfScope perf(PERF_HASH);
+    TraceClock::time_point start;
+    if (TRACE_ENABLED) start = TraceClock::now();
+    q->kmer_hashes.clear();
+    q->kmer_hashes.reserve(q->query_kmers.size());
+    for (const auto & m : q->query_kmers) {
+        q->kmer_hashes.emplace_back(hash_kmer(root->hash_pair(), m));
+    }
+    if (TRACE_ENABLED) trace_hash(q->id, q->kmer_hashes.size(), seconds_since(start));
+}
+
+void hash_queries(const BloomTree* root, QuerySet & qs) {
+    for (auto & q : qs) {
+        hash_query(root, q);
+    }
+}
+
+// return the (weighted) number of query kmers found in the filter
+float query_hits(const BF* bf, QueryInfo* q) {
+    assert(q->kmer_hashes.size() == q->query_kmers.size());
     float weight = 1.0;
-    auto bf = root->bf();
     float c = 0;
     unsigned n = 0;
     bool weighted = 0;
     if (q->weight.empty()){
 	weighted=0;
     } else { weighted = 1; }
-    for (const auto & m : q->query_kmers) {
-        //DEBUG: std::cout << "checking: " << m.to_str();
+    for (const auto & h : q->kmer_hashes) {
 	if (weighted){
 		if(q->weight.size() > n){ 
 			weight=q->weight[n]; 
@@ -107,13 +191,61 @@ bool query_passes(BloomTree* root, QueryInfo*  q) {//const std::set<jellyfish::m
 			exit(3);
 		}
 	}
-        if (bf->contains(m)) c+=weight;
+        if (bf->contains(h)) c+=weight;
 	n++;
-        //DEBUG: std::cout << c << std::endl;
     }
-    std::cerr << root->name() <<std::endl;
-    std::cerr << c << " " << QUERY_THRESHOLD << " " << q->query_kmers.size() << std::endl;
-    return (c >= QUERY_THRESHOLD * q->query_kmers.size());
+    return c;
+}
+
+// query_hits() against the filter of the given node, traced if enabled
+float probe_node(const BloomTree* node, const BF* bf, QueryInfo* q) {
+    PerfScope perf(PERF_PROBE, node);
+    if (!TRACE_ENABLED) return query_hits(bf, q);
+
+    auto start = TraceClock::now();
+    float c = query_hits(bf, q);
+    trace_probe(node->name(), q->id, q->kmer_hashes.size(), c, seconds_since(start));
+    return c;
+}
+
+// record a visit of node by the queries in [first, last), which found its
+// filter already in memory (hit) or loaded it starting at start
+template <class It>
+void trace_node_visit(const BloomTree* node, It first, It last, bool hit,
+    TraceClock::time_point start) {
+    std::vector<std::size_t> ids;
+    for (It it = first; it != last; ++it) ids.push_back((*it)->id);
+    trace_visit(node->name(), ids, hit,
+        hit ? 0 : file_size(node->name()), hit ? 0 : seconds_since(start));
+}
+
+// return the filter of a node about to be tested against the queries in
+// [first, last), loading it if necessary; traced once per visit, however many
+// queries there are
+template <class It>
+const BF* visit_node(BloomTree* node, It first, It last) {
+    if (!TRACE_ENABLED) return node->bf();
+
+    bool hit = node->is_loaded();
+    auto start = TraceClock::now();
+    const BF* bf = node->bf();
+    trace_node_visit(node, first, last, hit, start);
+    return bf;
+}
+
+float query_hits(BloomTree* root, QueryInfo* q) {
+    return probe_node(root, visit_node(root, &q, &q + 1), q);
+}
+
+bool hits_pass(const BloomTree* node, QueryInfo* q, float c) {
+    bool passed = (c >= QUERY_THRESHOLD * q->query_kmers.size());
+    if (TRACE_ENABLED) trace_decision(node->name(), q->id, passed);
+    return passed;
+}
+
+// return true if the filter at this node contains > QUERY_THRESHOLD kmers
+bool query_passes(BloomTree* root, QueryInfo*  q) {//const std::set<jellyfish::mer_dna> & q) {
+    return hits_pass(root, q, query_hits(root, q));
 }
 
 // recursively walk down the tree, proceeding to children only
@@ -185,9 +317,14 @@ void query_from_file(
  * Batch querying
  ******/
 
+// print the results in the format:
+//      *QUERY_NAME number_results
+//      BF names
+// where the name is the record's for FASTA/FASTQ input and the sequence itself
+// for raw one-per-line queries.
 void print_query_results(const QuerySet & qs, std::ostream & out) {
     for (auto& q : qs) {
-        out << "*" << q->query << " " << q->matching.size() << std::endl;
+        out << "*" << q->name << " " << q->matching.size() << std::endl;
         for (const auto& n : q->matching) {
             out << n->name() << std::endl;
         }
@@ -195,106 +332,277 @@ void print_query_results(const QuerySet & qs, std::ostream & out) {
 }
 
 
-void query_batch(BloomTree* root, QuerySet & qs) {
+void query_leaves(BloomTree* root, QuerySet & qs);
+
+// walk the tree with a set of queries. Queries that pass a node in scan_below
+// (if given) are tested against every leaf below it without further pruning.
+void query_batch(
+    BloomTree* root,
+    QuerySet & qs,
+    const std::set<const BloomTree*> * scan_below = nullptr
+) {
     // how many children do we have?
     bool has_children = root->child(0) || root->child(1);
 
     // construct the set of queries that pass this node
+    const BF* bf = visit_node(root, qs.begin(), qs.end());
     QuerySet pass;
-    unsigned n = 0;
     for (auto & q : qs) {
-        if (query_passes(root, q)) { //q->query_kmers)) {
+        if (hits_pass(root, q, probe_node(root, bf, q))) {
             if (has_children) {
                 pass.emplace_back(q);
             } else {
                 q->matching.emplace_back(root);
-                n++;
             }
         } 
     }
 
-    // $(node name) $(internal / leaf) $(number of matches)
-    if (has_children) { //Changing format
-        std::cout << root->name() << " internal " << pass.size() << std::endl;
-    } else {
-        std::cout << root->name() << " leaf " << n << std::endl;
-    }
-
     if (pass.size() > 0) {
+        if (scan_below != nullptr && scan_below->count(root) > 0) {
+            query_leaves(root, pass);
+            return;
+        }
+
         // if present, recurse into left child
         if (root->child(0)) {
-            query_batch(root->child(0), pass);
+            query_batch(root->child(0), pass, scan_below);
         }
 
         // if present, recurse into right child
         if (root->child(1)) {
-            query_batch(root->child(1), pass);
+            query_batch(root->child(1), pass, scan_below);
         }
     }
 } 
 
 
-void query_leaves (BloomTree* root, QuerySet & qs) {
-    // how many children do we have?
-    bool has_children = root->child(0) || root->child(1);
+void collect_leaves(BloomTree* root, std::vector<BloomTree*> & out) {
+    if (root == nullptr) return;
+    if (root->num_children() == 0) {
+        out.push_back(root);
+        return;
+    }
+    collect_leaves(root->child(0), out);
+    collect_leaves(root->child(1), out);
+}
 
-    // construct the set of queries that pass this node
-	// But only for leaf nodes
-	unsigned n=0;
-	if (!has_children) {
-    		for (auto & q : qs) {
-		        if (query_passes(root, q)) {
-		                q->matching.emplace_back(root);
-		                n++;
-       	 		}
-    		}
-	}
+// where a file starts on disk: (device, physical offset of its first extent,
+// inode). The offset is 0 if the filesystem can't report it, in which case
+// files sort by inode, which usually follows allocation order.
+struct DiskLocation {
+    uint64_t dev, physical, ino;
+    bool operator<(const DiskLocation & o) const {
+        return std::tie(dev, physical, ino) < std::tie(o.dev, o.physical, o.ino);
+    }
+};
+
+DiskLocation disk_location(const std::string & fn) {
+    DiskLocation loc{0, 0, 0};
+    int fd = open(fn.c_str(), O_RDONLY);
+    if (fd == -1) return loc;
 
-    // $(node name) $(internal / leaf) $(number of matches)
-    if (!has_children) { //Changing format	
-        std::cout << root->name() << " leaf " << n << std::endl;
+    struct stat buf;
+    if (fstat(fd, &buf) == 0) {
+        loc.dev = buf.st_dev;
+        loc.ino = buf.st_ino;
     }
 
-        // if present, recurse into left child
-        if (root->child(0)) {
-            query_leaves(root->child(0), qs);
+    // room for the fiemap header plus one extent
+    uint64_t req[(sizeof(struct fiemap) + sizeof(struct fiemap_extent)) / sizeof(uint64_t) + 1];
+    std::memset(req, 0, sizeof(req));
+    struct fiemap* fm = reinterpret_cast<struct fiemap*>(req);
+    fm->fm_length = ~0ULL;
+    fm->fm_extent_count = 1;
+    if (ioctl(fd, FS_IOC_FIEMAP, fm) == 0 && fm->fm_mapped_extents > 0) {
+        loc.physical = fm->fm_extents[0].fe_physical;
+    }
+    close(fd);
+    return loc;
+}
+
+// test every query against every leaf below root. Leaves are read in on-disk
+// order by QUERY_THREADS workers, each of which loads one leaf at a time
+// (outside the node cache, so the upper levels of the tree stay resident)
+// and evaluates the whole batch against it. Results are reported in tree
+// order, as if the leaves had been visited recursively.
+void query_leaves(BloomTree* root, QuerySet & qs) {
+    std::vector<BloomTree*> leaves;
+    collect_leaves(root, leaves);
+    if (leaves.empty()) return;
+
+    std::vector<std::pair<DiskLocation, std::size_t> > order;
+    for (std::size_t i = 0; i < leaves.size(); i++) {
+        order.emplace_back(disk_location(leaves[i]->name()), i);
+    }
+    std::sort(order.begin(), order.end());
+
+    const std::vector<QueryInfo*> queries(qs.begin(), qs.end());
+    std::vector<std::vector<QueryInfo*> > matches(leaves.size());
+    std::atomic<std::size_t> next(0);
+    const unsigned nthreads = std::max(1u, std::min<unsigned>(QUERY_THREADS, leaves.size()));
+
+    auto worker = [&]() {
+        std::size_t i;
+        while ((i = next++) < order.size()) {
+            // keep the disk busy with the leaf after the ones in flight
+            if (i + nthreads < order.size()) {
+                readahead_file(leaves[order[i + nthreads].second]->name());
+            }
+
+            const BloomTree* leaf = leaves[order[i].second];
+            TraceClock::time_point start;
+            if (TRACE_ENABLED) start = TraceClock::now();
+            BF* detached = leaf->is_loaded() ? nullptr : leaf->load_detached();
+            const BF* bf = (detached != nullptr) ? detached : leaf->bf();
+            if (TRACE_ENABLED) {
+                trace_node_visit(leaf, queries.begin(), queries.end(), detached == nullptr, start);
+            }
+
+            auto & m = matches[order[i].second];
+            for (auto & q : queries) {
+                if (hits_pass(leaf, q, probe_node(leaf, bf, q))) {
+                    m.emplace_back(q);
+                }
+            }
+            delete detached;
         }
+    };
 
-        // if present, recurse into right child
-        if (root->child(1)) {
-            query_leaves(root->child(1), qs);
+    std::vector<std::thread> threads;
+    for (unsigned t = 1; t < nthreads; t++) {
+        threads.emplace_back(worker);
+    }
+    worker();
+    for (auto & t : threads) {
+        t.join();
+    }
+
+    for (std::size_t i = 0; i < leaves.size(); i++) {
+        for (auto & q : matches[i]) {
+            q->matching.emplace_back(leaves[i]);
         }
-    
+    }
+}
+
+/******
+ * Top-k querying
+ ******/
+
+// a node on the best-first frontier, ordered by the fraction of query kmers
+// found in its filter
+struct FrontierNode {
+    float score;
+    BloomTree* node;
+    bool operator<(const FrontierNode & o) const { return score < o.score; }
+};
+
+// a query with no valid kmers (every one contains an N) scores 0
+float query_score(BloomTree* root, QueryInfo* q) {
+    if (q->query_kmers.empty()) return 0;
+    root->increment_usage();
+    return query_hits(root, q) / q->query_kmers.size();
+}
+
+// find the k leaves with the highest fraction of query kmers. A union filter
+// contains every kmer of its children, so a node's score is an upper bound on
+// the score of every leaf below it; expanding the frontier best-first, a leaf
+// that reaches the top of the queue beats everything not yet explored.
+// Queries without valid kmers are skipped. Returns the number of nodes
+// visited.
+std::size_t query_topk(BloomTree* root, QueryInfo* q, unsigned k) {
+    if (q->query_kmers.empty()) return 0;
+    std::priority_queue<FrontierNode> frontier;
+    frontier.push(FrontierNode{query_score(root, q), root});
+    std::size_t visited = 1;
+
+    while (!frontier.empty() && q->matching.size() < k) {
+        FrontierNode best = frontier.top();
+        frontier.pop();
+
+        if (best.node->num_children() == 0) {
+            q->matching.emplace_back(best.node);
+            q->scores.emplace_back(best.score);
+            continue;
+        }
+        for (int i = 0; i < 2; i++) {
+            BloomTree* c = best.node->child(i);
+            if (c != nullptr) {
+                frontier.push(FrontierNode{query_score(c, q), c});
+                visited++;
+            }
+        }
+    }
+    return visited;
+}
+
+// print the results in the format:
+//      *QUERY_NAME number_results
+//      BF_name score
+void print_topk_results(const QuerySet & qs, std::ostream & out) {
+    for (auto& q : qs) {
+        out << "*" << q->name << " " << q->matching.size() << std::endl;
+        for (std::size_t i = 0; i < q->matching.size(); i++) {
+            out << q->matching[i]->name() << " " << q->scores[i] << std::endl;
+        }
+    }
+}
+
+// ids for the queries, in the order they are read
+static std::size_t next_query_id = 0;
+
+// read up to QUERY_WINDOW queries from the reader into qs, keeping their
+// record names, and hash their kmers; sequences shorter than k are skipped. Returns the number of queries
+// read.
+std::size_t read_query_window(BloomTree* root, SeqReader & reader, QuerySet & qs) {
+    std::string name, seq;
+    std::size_t n = 0;
+    while (n < QUERY_WINDOW && reader.next(name, seq)) {
+        if (seq.size() < jellyfish::mer_dna::k()) continue;
+        qs.emplace_back(new QueryInfo(seq));
+        qs.back()->id = next_query_id++;
+        if (!name.empty()) qs.back()->name = name;
+        n++;
+    }
+    hash_queries(root, qs);
+    return n;
+}
+
+void free_query_window(QuerySet & qs) {
+    for (auto & p : qs) {
+        delete p;
+    }
+    qs.clear();
 }
 
+// read FASTA, FASTQ or raw queries (optionally gzipped) in windows of at most
+// QUERY_WINDOW queries, so memory stays bounded regardless of input size. Each
+// window is run through the batch engine and its results written out before
+// the next window is read.
 void batch_query_from_file(
     BloomTree* root, 
     const std::string & fn,
     std::ostream & o
 ) { 
-    // read in the query lines from the file.
-    std::string line;
+    SeqReader reader(fn);
+    DIE_IF(!reader.good(), "Couldn't open query file.");
+
     QuerySet qs;
-    std::ifstream in(fn);
-    DIE_IF(!in.good(), "Couldn't open query file.");
     std::size_t n = 0;
-    while (getline(in, line)) {
-        line = Trim(line);
-        if (line.size() < jellyfish::mer_dna::k()) continue;
-        qs.emplace_back(new QueryInfo(line));
-        n++;
+    while (read_query_window(root, reader, qs) > 0) {
+        n += qs.size();
+        std::cerr << "Querying window of " << qs.size() << " queries ("
+            << n << " total)." << std::endl;
+
+        // batch process the queries
+        if (recording()) record_batch("batch", qs);
+        query_batch(root, qs);
+        print_query_results(qs, o);
+        o.flush();
+
+        // free the query info objects
+        free_query_window(qs);
     }
-    in.close();
     std::cerr << "Read " << n << " queries." << std::endl;
-
-    // batch process the queries
-    query_batch(root, qs);
-    print_query_results(qs, o);
-
-    // free the query info objects
-    for (auto & p : qs) {
-        delete p;
-    }
 }
 
 void batch_weightedquery_from_file(
@@ -319,12 +627,15 @@ void batch_weightedquery_from_file(
 	
         if (line.size() < jellyfish::mer_dna::k()) continue;
         qs.emplace_back(new QueryInfo(line, wfline));
+        qs.back()->id = next_query_id++;
         n++;
     }
     in.close();
     std::cerr << "Read " << n << " queries." << std::endl;
 
     // batch process the queries
+    if (recording()) record_batch("weighted", qs);
+    hash_queries(root, qs);
     query_batch(root, qs);
     print_query_results(qs, o);
 
@@ -340,25 +651,143 @@ void leaf_query_from_file(
 	const std::string & fn,
 	std::ostream & o
 ) {
-	std::string line;
+	SeqReader reader(fn);
+	DIE_IF(!reader.good(), "Couldn't open query file.");
+
 	QuerySet qs;
-	std::ifstream in(fn);
-	DIE_IF(!in.good(), "Couldn't open query file.");
 	std::size_t n=0;
-	while (getline(in, line)) {
-		line = Trim(line);
-		if (line.size() < jellyfish::mer_dna::k()) continue;
-		qs.emplace_back(new QueryInfo(line));
-		n++;
+	while (read_query_window(root, reader, qs) > 0) {
+		n += qs.size();
+
+		// batch process the queries on ONLY the leaves
+		if (recording()) record_batch("leaf", qs);
+		query_leaves(root, qs);
+		print_query_results(qs, o);
+		o.flush();
+
+		free_query_window(qs);
 	}
-	in.close();
 	std::cerr << "Read " << n << " queries." << std::endl;
+}
 
-	// batch process the queries on ONLY the leaves
-	query_leaves(root, qs);
-	print_query_results(qs, o);
-	
-	for (auto & p : qs) {
-		delete p;
-	}
+void topk_query_from_file(
+    BloomTree* root,
+    const std::string & fn,
+    unsigned k,
+    std::ostream & o
+) {
+    SeqReader reader(fn);
+    DIE_IF(!reader.good(), "Couldn't open query file.");
+
+    QuerySet qs;
+    std::size_t n = 0;
+    std::size_t visited = 0;
+    while (read_query_window(root, reader, qs) > 0) {
+        n += qs.size();
+        if (recording()) record_batch("topk:" + std::to_string(k), qs);
+        for (auto & q : qs) {
+            visited += query_topk(root, q, k);
+        }
+        print_topk_results(qs, o);
+        o.flush();
+
+        free_query_window(qs);
+    }
+    std::cerr << "Read " << n << " queries; visited " << visited
+        << " nodes." << std::endl;
+}
+
+/******
+ * Planned querying
+ ******/
+
+double average_kmers(const QuerySet & qs) {
+    double total = 0;
+    for (const auto & q : qs) {
+        total += q->query_kmers.size();
+    }
+    return qs.empty() ? 0 : total / qs.size();
+}
+
+void run_plan(BloomTree* root, QuerySet & qs, const QueryPlan & plan) {
+    switch (plan.type) {
+        case PLAN_SCAN: query_leaves(root, qs); break;
+        case PLAN_HYBRID: query_batch(root, qs, &plan.scan_below); break;
+        default: query_batch(root, qs); break;
+    }
+}
+
+// like batch_query_from_file(), but each window is executed with the plan the
+// cost model predicts to be cheapest given the current cache contents.
+void planned_query_from_file(
+    BloomTree* root,
+    const std::string & tree_file,
+    const std::string & fn,
+    std::ostream & o
+) {
+    NodeStatsMap stats = load_node_stats(root, tree_file);
+
+    SeqReader reader(fn);
+    DIE_IF(!reader.good(), "Couldn't open query file.");
+
+    QuerySet qs;
+    std::size_t n = 0;
+    while (read_query_window(root, reader, qs) > 0) {
+        n += qs.size();
+        QueryPlan plan = plan_query(root, stats, qs.size(), average_kmers(qs));
+        explain_plan(plan, std::cerr);
+
+        if (recording()) record_batch("plan", qs);
+        run_plan(root, qs, plan);
+        print_query_results(qs, o);
+        o.flush();
+
+        free_query_window(qs);
+    }
+    std::cerr << "Read " << n << " queries." << std::endl;
+}
+
+// print the plan that would be used for the first window of queries
+void explain_query_from_file(
+    BloomTree* root,
+    const std::string & tree_file,
+    const std::string & fn,
+    std::ostream & o
+) {
+    NodeStatsMap stats = load_node_stats(root, tree_file);
+
+    SeqReader reader(fn);
+    DIE_IF(!reader.good(), "Couldn't open query file.");
+
+    QuerySet qs;
+    read_query_window(root, reader, qs);
+    QueryPlan plan = plan_query(root, stats, qs.size(), average_kmers(qs));
+    explain_plan(plan, o);
+    free_query_window(qs);
+}
+
+// run one batch in the given mode, as recorded by record_batch(): "batch",
+// "weighted", "leaf", "plan" (needs stats) or "topk:<k>"
+void execute_batch(
+    BloomTree* root,
+    QuerySet & qs,
+    const std::string & mode,
+    const NodeStatsMap * stats
+) {
+    hash_queries(root, qs);
+    if (mode == "batch" || mode == "weighted") {
+        query_batch(root, qs);
+    } else if (mode == "leaf") {
+        query_leaves(root, qs);
+    } else if (mode == "plan") {
+        DIE_IF(stats == nullptr, "Planned batch needs node statistics");
+        run_plan(root, qs, plan_query(root, *stats, qs.size(), average_kmers(qs)));
+    } else if (mode.compare(0, 5, "topk:") == 0) {
+        unsigned k = unsigned(atoi(mode.substr(5).c_str()));
+        for (auto & q : qs) {
+            query_topk(root, q, k);
+        }
+    } else {
+        DIE("Unknown batch mode: " + mode);
+    }
 }
@@ -8,12 +8,20 @@
 #include <iostream>
 
 #include "BloomTree.h"
+#include "Plan.h"
 
 extern float QUERY_THRESHOLD;
 
+// max number of queries held in memory at once by the batch query paths
+extern std::size_t QUERY_WINDOW;
+
+// number of threads used to scan leaves
+extern unsigned QUERY_THREADS;
+
 struct QueryInfo {
-    QueryInfo(const std::string & q) : query(q), query_kmers(kmers_in_string(q)) {}
+    QueryInfo(const std::string & q) : name(q), query(q), query_kmers(kmers_in_string(q)) {}
     QueryInfo(const std::string & q, const std::string & w){
+	name = q;
 	query = q;
 	query_kmers = kmers_in_string(q);
 	std::vector<std::string> fields;
@@ -44,9 +52,13 @@ struct QueryInfo {
     }
     ~QueryInfo() {}
    
+    std::size_t id = 0;
+    std::string name;   // FASTA/FASTQ record name; the sequence for raw input
     std::string query;
     std::set<jellyfish::mer_dna> query_kmers;
+    std::vector<KmerHash> kmer_hashes;  // in the order of query_kmers
     std::vector<const BloomTree*> matching;
+    std::vector<float> scores; // fraction of kmers hit in matching (top-k only)
     std::vector<float> weight;
 };
 
@@ -59,7 +71,14 @@ void query_string(BloomTree* root, const std::string & q, std::vector<BloomTree*
 void query(BloomTree* root, const std::set<jellyfish::mer_dna> & q, std::vector<BloomTree*> & out);
 void check_bt(BloomTree* root);
 void draw_bt(BloomTree* root, std::string outfile);
-void compress_bt(BloomTree* root);
+// bytes of filter data compress_bt may have in memory at once
+extern uint64_t COMPRESS_MEMORY;
+
+void compress_bt(BloomTree* root, unsigned nb_threads);
 
 void leaf_query_from_file(BloomTree* root, const std::string & fn, std::ostream & o);
+void topk_query_from_file(BloomTree* root, const std::string & fn, unsigned k, std::ostream & o);
+void planned_query_from_file(BloomTree* root, const std::string & tree_file, const std::string & fn, std::ostream & o);
+void execute_batch(BloomTree* root, QuerySet & qs, const std::string & mode, const NodeStatsMap * stats);
+void explain_query_from_file(BloomTree* root, const std::string & tree_file, const std::string & fn, std::ostream & o);
 #endif
@@ -0,0 +1,250 @@
+#include "Replay.h"
+#include "Plan.h"
+#include "util.h"
+#include "gzstream.h"
+
+#include <algorithm>
+#include <chrono>
+#include <condition_variable>
+#include <mutex>
+#include <queue>
+#include <sstream>
+#include <thread>
+
+/* Replay files are gzipped text. Each batch is a header line
+       #batch <microseconds since recording started> <mode> <threshold> <n>
+   followed by n query lines, each a sequence optionally followed by a tab
+   and its space-separated kmer weights.
+*/
+
+using ReplayClock = std::chrono::steady_clock;
+
+static ogzstream* record_out = nullptr;
+static ReplayClock::time_point record_start;
+static std::mutex record_lock;
+
+void start_recording(const std::string & fn) {
+    record_out = new ogzstream(fn.c_str());
+    DIE_IF(!record_out->rdbuf()->is_open(), "Couldn't open replay file " + fn);
+    record_start = ReplayClock::now();
+    std::cerr << "Recording queries to " << fn << std::endl;
+}
+
+void stop_recording() {
+    if (record_out != nullptr) {
+        record_out->close();
+        delete record_out;
+        record_out = nullptr;
+    }
+}
+
+bool recording() {
+    return record_out != nullptr;
+}
+
+void record_batch(const std::string & mode, const QuerySet & qs) {
+    std::lock_guard<std::mutex> g(record_lock);
+    auto usec = std::chrono::duration_cast<std::chrono::microseconds>(
+        ReplayClock::now() - record_start).count();
+    *record_out << "#batch " << usec << " " << mode << " " << QUERY_THRESHOLD
+        << " " << qs.size() << "\n";
+    for (const auto & q : qs) {
+        *record_out << q->query;
+        for (std::size_t i = 0; i < q->weight.size(); i++) {
+            *record_out << ((i == 0) ? '\t' : ' ') << q->weight[i];
+        }
+        *record_out << "\n";
+    }
+}
+
+namespace {
+
+struct ReplayBatch {
+    std::size_t id;
+    uint64_t usec;
+    std::string mode;
+    float threshold;
+    std::vector<std::string> queries;
+    std::vector<std::string> weights;
+    ReplayClock::time_point arrival;
+};
+
+struct ReplayResult {
+    std::size_t id;
+    std::size_t nb_queries;
+    std::string mode;
+    double latency;     // arrival to completion, including time queued
+    double service;     // execution time only
+    CacheCounters cache;
+};
+
+bool read_replay_batch(igzstream & in, ReplayBatch & b) {
+    std::string line;
+    while (getline(in, line) && line.compare(0, 7, "#batch ") != 0) {}
+    if (!in) return false;
+
+    std::istringstream header(line.substr(7));
+    std::size_t n = 0;
+    DIE_IF(!(header >> b.usec >> b.mode >> b.threshold >> n), "Malformed replay header: " + line);
+    b.queries.clear();
+    b.weights.clear();
+    for (std::size_t i = 0; i < n; i++) {
+        DIE_IF(!getline(in, line), "Truncated replay file");
+        auto tab = line.find('\t');
+        b.queries.push_back(line.substr(0, tab));
+        b.weights.push_back((tab == std::string::npos) ? "" : line.substr(tab + 1));
+    }
+    return true;
+}
+
+double seconds(ReplayClock::duration d) {
+    return std::chrono::duration<double>(d).count();
+}
+
+std::string distribution(std::vector<double> v) {
+    if (v.empty()) return "n/a";
+    std::sort(v.begin(), v.end());
+    auto at = [&](double p) { return v[std::min(v.size() - 1, std::size_t(p * v.size()))]; };
+    std::ostringstream oss;
+    oss << "p50=" << at(0.5) << "s p90=" << at(0.9) << "s p99=" << at(0.99)
+        << "s max=" << v.back() << "s";
+    return oss.str();
+}
+
+} // namespace
+
+// replay the batches in replay_file against the tree. A dispatcher releases
+// each batch at its recorded arrival time divided by speed (or immediately if
+// speed is 0) to `concurrency` client threads. The query engine itself runs
+// one batch at a time, so latency includes the time a batch waits for it.
+// Per-request timings and cache activity are written to out as TSV.
+void replay(
+    BloomTree* root,
+    const std::string & tree_file,
+    const std::string & replay_file,
+    unsigned concurrency,
+    double speed,
+    std::ostream & out
+) {
+    igzstream in(replay_file.c_str());
+    DIE_IF(!in.rdbuf()->is_open(), "Couldn't open replay file " + replay_file);
+    CACHE_COUNTERS_ENABLED = true;
+
+    NodeStatsMap stats;
+    bool have_stats = false;
+
+    std::queue<ReplayBatch*> pending;
+    bool dispatched_all = false;
+    std::mutex queue_lock, engine_lock, result_lock;
+    std::condition_variable ready;
+    std::vector<ReplayResult> results;
+
+    auto client = [&]() {
+        while (true) {
+            ReplayBatch* b = nullptr;
+            {
+                std::unique_lock<std::mutex> g(queue_lock);
+                ready.wait(g, [&]() { return !pending.empty() || dispatched_all; });
+                if (pending.empty()) return;
+                b = pending.front();
+                pending.pop();
+            }
+
+            ReplayResult r;
+            r.id = b->id;
+            r.nb_queries = b->queries.size();
+            r.mode = b->mode;
+            {
+                std::lock_guard<std::mutex> g(engine_lock);
+                auto start = ReplayClock::now();
+                CacheCounters before = BloomTree::cache_counters();
+
+                QUERY_THRESHOLD = b->threshold;
+                if (b->mode == "plan" && !have_stats) {
+                    stats = load_node_stats(root, tree_file);
+                    have_stats = true;
+                }
+                QuerySet qs;
+                for (std::size_t i = 0; i < b->queries.size(); i++) {
+                    qs.emplace_back(new QueryInfo(b->queries[i], b->weights[i]));
+                }
+                execute_batch(root, qs, b->mode, have_stats ? &stats : nullptr);
+                for (auto & q : qs) {
+                    delete q;
+                }
+
+                CacheCounters after = BloomTree::cache_counters();
+                r.cache.hits = after.hits - before.hits;
+                r.cache.misses = after.misses - before.misses;
+                r.cache.bytes_loaded = after.bytes_loaded - before.bytes_loaded;
+                r.service = seconds(ReplayClock::now() - start);
+            }
+            r.latency = seconds(ReplayClock::now() - b->arrival);
+            delete b;
+
+            std::lock_guard<std::mutex> g(result_lock);
+            results.push_back(r);
+        }
+    };
+
+    std::vector<std::thread> clients;
+    for (unsigned t = 0; t < std::max(1u, concurrency); t++) {
+        clients.emplace_back(client);
+    }
+
+    // dispatch the batches on the recorded schedule
+    auto start = ReplayClock::now();
+    std::size_t n = 0;
+    ReplayBatch* b = new ReplayBatch;
+    while (read_replay_batch(in, *b)) {
+        b->id = n++;
+        if (speed > 0) {
+            std::this_thread::sleep_until(start + std::chrono::microseconds(uint64_t(b->usec / speed)));
+        }
+        b->arrival = ReplayClock::now();
+        {
+            std::lock_guard<std::mutex> g(queue_lock);
+            pending.push(b);
+        }
+        ready.notify_one();
+        b = new ReplayBatch;
+    }
+    delete b;
+    {
+        std::lock_guard<std::mutex> g(queue_lock);
+        dispatched_all = true;
+    }
+    ready.notify_all();
+    for (auto & t : clients) {
+        t.join();
+    }
+    double wall = seconds(ReplayClock::now() - start);
+
+    // report
+    std::sort(results.begin(), results.end(),
+        [](const ReplayResult & a, const ReplayResult & b) { return a.id < b.id; });
+    out << "#batch\tqueries\tmode\tlatency\tservice\tcache_hits\tcache_misses\tbytes_loaded" << std::endl;
+    std::vector<double> latencies, services;
+    CacheCounters total{0, 0, 0};
+    std::size_t nb_queries = 0;
+    for (const auto & r : results) {
+        out << r.id << "\t" << r.nb_queries << "\t" << r.mode << "\t" << r.latency
+            << "\t" << r.service << "\t" << r.cache.hits << "\t" << r.cache.misses
+            << "\t" << r.cache.bytes_loaded << std::endl;
+        latencies.push_back(r.latency);
+        services.push_back(r.service);
+        total.hits += r.cache.hits;
+        total.misses += r.cache.misses;
+        total.bytes_loaded += r.cache.bytes_loaded;
+        nb_queries += r.nb_queries;
+    }
+
+    std::cerr << "Replayed " << results.size() << " batches (" << nb_queries
+        << " queries) in " << wall << "s with " << concurrency << " clients" << std::endl;
+    std::cerr << "Latency: " << distribution(latencies) << std::endl;
+    std::cerr << "Service: " << distribution(services) << std::endl;
+    uint64_t lookups = total.hits + total.misses;
+    std::cerr << "Cache: " << total.hits << " hits, " << total.misses << " misses ("
+        << (lookups ? 100.0 * total.hits / lookups : 0) << "% hit rate), "
+        << total.bytes_loaded / 1e6 << " MB loaded" << std::endl;
+}
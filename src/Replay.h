@@ -0,0 +1,25 @@
+#ifndef REPLAY_H
+#define REPLAY_H
+
+#include <string>
+#include <iostream>
+#include "Query.h"
+
+// recording: when started, every batch executed by the query paths is
+// appended to a gzipped replay file with its arrival time, mode and
+// threshold.
+void start_recording(const std::string & fn);
+void stop_recording();
+bool recording();
+void record_batch(const std::string & mode, const QuerySet & qs);
+
+void replay(
+    BloomTree* root,
+    const std::string & tree_file,
+    const std::string & replay_file,
+    unsigned concurrency,
+    double speed,
+    std::ostream & out
+);
+
+#endif
@@ -0,0 +1,97 @@
+#include "SeqReader.h"
+#include "util.h"
+
+SeqReader::SeqReader(const std::string & filename) :
+    in(filename.c_str()),
+    format(RAW),
+    opened(false),
+    has_pending(false)
+{
+    opened = in.rdbuf()->is_open();
+
+    // peek at the first non-empty line to decide the format
+    if (opened && next_line(pending)) {
+        has_pending = true;
+        if (pending[0] == '>') {
+            format = FASTA;
+        } else if (pending[0] == '@') {
+            format = FASTQ;
+        }
+    }
+}
+
+SeqReader::~SeqReader() {
+    in.close();
+}
+
+bool SeqReader::good() const {
+    return opened;
+}
+
+// return the next non-empty line (with whitespace and '\r' trimmed)
+bool SeqReader::next_line(std::string & line) {
+    if (has_pending) {
+        line = pending;
+        has_pending = false;
+        return true;
+    }
+    while (getline(in, line)) {
+        if (!line.empty() && line.back() == '\r') line.pop_back();
+        line = Trim(line);
+        if (line.size() > 0) return true;
+    }
+    return false;
+}
+
+bool SeqReader::next_fasta(std::string & name, std::string & seq) {
+    std::string line;
+    if (!next_line(line)) return false;
+    DIE_IF(line[0] != '>', "Malformed FASTA record: " + line);
+    name = line.substr(1);
+    seq.clear();
+
+    // sequence lines continue until the next header
+    while (next_line(line)) {
+        if (line[0] == '>') {
+            pending = line;
+            has_pending = true;
+            break;
+        }
+        seq += line;
+    }
+    return true;
+}
+
+bool SeqReader::next_fastq(std::string & name, std::string & seq) {
+    std::string line;
+    if (!next_line(line)) return false;
+    DIE_IF(line[0] != '@', "Malformed FASTQ record: " + line);
+    name = line.substr(1);
+    seq.clear();
+
+    // sequence lines continue until the '+' separator
+    while (next_line(line) && line[0] != '+') {
+        seq += line;
+    }
+
+    // the quality string has the same length as the sequence, and may
+    // itself begin with '@', so we count characters rather than look for
+    // the next header
+    std::size_t qual_len = 0;
+    while (qual_len < seq.size() && next_line(line)) {
+        qual_len += line.size();
+    }
+    DIE_IF(qual_len != seq.size(), "Truncated FASTQ record: " + name);
+    return true;
+}
+
+// read the next record; name is empty for raw sequences
+bool SeqReader::next(std::string & name, std::string & seq) {
+    switch (format) {
+        case FASTA: return next_fasta(name, seq);
+        case FASTQ: return next_fastq(name, seq);
+        default:
+            name.clear();
+            return next_line(seq);
+    }
+}
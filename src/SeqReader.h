@@ -0,0 +1,33 @@
+#ifndef SEQREADER_H
+#define SEQREADER_H
+
+#include <string>
+#include <cstring>
+#include "gzstream.h"
+
+// reads sequence records one at a time from a (possibly gzipped) file.  The
+// format is detected from the first line: FASTA ('>'), FASTQ ('@'), or raw
+// (one sequence per line). Multi-line FASTA and FASTQ records are supported.
+class SeqReader {
+public:
+    SeqReader(const std::string & filename);
+    ~SeqReader();
+
+    bool good() const;
+    bool next(std::string & name, std::string & seq);
+
+private:
+    enum Format { RAW, FASTA, FASTQ };
+
+    bool next_line(std::string & line);
+    bool next_fasta(std::string & name, std::string & seq);
+    bool next_fastq(std::string & name, std::string & seq);
+
+    igzstream in;
+    Format format;
+    bool opened;
+    std::string pending;
+    bool has_pending;
+};
+
+#endif
@@ -0,0 +1,148 @@
+#include "Sketch.h"
+#include "util.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+#include <fstream>
+
+bool SKETCH_ENABLED = false;
+std::size_t SKETCH_SIZE = 1024;
+
+static const uint64_t SKETCH_MAGIC = 0x484354454b53ULL;  // "SKETCH"
+
+Sketch::Sketch(std::size_t k, uint64_t nbits) :
+    k(k),
+    num_bits(nbits),
+    sorted(true)
+{
+}
+
+// record a set bit; each position must be added only once
+void Sketch::add(uint64_t pos) {
+    uint64_t h = mix64(pos);
+    if (sorted && !mins.empty()) {
+        std::make_heap(mins.begin(), mins.end());
+    }
+    sorted = false;
+    if (mins.size() < k) {
+        mins.push_back(h);
+        std::push_heap(mins.begin(), mins.end());
+    } else if (h < mins.front()) {
+        std::pop_heap(mins.begin(), mins.end());
+        mins.back() = h;
+        std::push_heap(mins.begin(), mins.end());
+    }
+}
+
+const std::vector<uint64_t> & Sketch::values() const {
+    if (!sorted) {
+        std::sort(mins.begin(), mins.end());
+        sorted = true;
+    }
+    return mins;
+}
+
+// make this the sketch of the union of the two filters
+void Sketch::merge(const Sketch & other) {
+    const std::vector<uint64_t> & a = values();
+    const std::vector<uint64_t> & b = other.values();
+    std::vector<uint64_t> u;
+    u.reserve(k);
+    std::set_union(a.begin(), a.end(), b.begin(), b.end(), std::back_inserter(u));
+    if (u.size() > k) u.resize(k);
+    mins.swap(u);
+    num_bits = std::max(num_bits, other.num_bits);
+}
+
+uint64_t Sketch::nbits() const {
+    return num_bits;
+}
+
+// estimated number of set bits
+double Sketch::cardinality() const {
+    const std::vector<uint64_t> & v = values();
+    if (v.size() < k) return double(v.size());
+    return double(k - 1) / (double(v.back()) / std::pow(2.0, 64));
+}
+
+// estimate of BF::similarity() between the two sketched filters: the
+// Jaccard index of the set bits comes from the bottom k of the union, and
+// the size of the union from the kth smallest value.
+uint64_t Sketch::similarity(const Sketch & other, int type) const {
+    const std::vector<uint64_t> & a = values();
+    const std::vector<uint64_t> & b = other.values();
+
+    std::size_t in_union = 0, in_both = 0;
+    std::size_t i = 0, j = 0;
+    uint64_t kth = 0;
+    while (in_union < k && (i < a.size() || j < b.size())) {
+        if (j == b.size() || (i < a.size() && a[i] < b[j])) {
+            kth = a[i++];
+        } else if (i == a.size() || b[j] < a[i]) {
+            kth = b[j++];
+        } else {
+            kth = a[i++];
+            j++;
+            in_both++;
+        }
+        in_union++;
+    }
+    if (in_union == 0) return (type == 0) ? num_bits : 0;
+
+    double jaccard = double(in_both) / in_union;
+    double union_card = (in_union < k) ? double(in_union)
+        : double(k - 1) / (double(kth) / std::pow(2.0, 64));
+    uint64_t nbits = std::max(num_bits, other.num_bits);
+
+    if (type == 1) {
+        return uint64_t(jaccard * nbits);
+    } else if (type == 0) {
+        double differ = std::min(double(nbits), union_card * (1 - jaccard));
+        return nbits - uint64_t(differ);
+    }
+    DIE("ERROR: ONLY TWO TYPES IMPLEMENTED");
+    return 0;
+}
+
+// returns false if the file is missing or isn't a sketch of size k
+bool Sketch::load(const std::string & filename) {
+    std::ifstream in(filename, std::ios::binary);
+    if (!in) return false;
+    uint64_t header[4];
+    if (!in.read(reinterpret_cast<char*>(header), sizeof(header))) return false;
+    if (header[0] != SKETCH_MAGIC || header[1] != k || header[3] > k) return false;
+
+    num_bits = header[2];
+    mins.resize(header[3]);
+    if (!in.read(reinterpret_cast<char*>(mins.data()), mins.size() * sizeof(uint64_t))) {
+        mins.clear();
+        return false;
+    }
+    sorted = true;
+    return true;
+}
+
+void Sketch::save(const std::string & filename) const {
+    const std::vector<uint64_t> & v = values();
+    std::string tmp = filename + ".tmp";
+    {
+        std::ofstream out(tmp, std::ios::binary);
+        DIE_IF(!out, "Couldn't write sketch file " + tmp);
+        uint64_t header[4] = {SKETCH_MAGIC, k, num_bits, v.size()};
+        out.write(reinterpret_cast<const char*>(header), sizeof(header));
+        out.write(reinterpret_cast<const char*>(v.data()), v.size() * sizeof(uint64_t));
+        DIE_IF(!out, "Couldn't write sketch file " + tmp);
+    }
+    DIE_IF(rename(tmp.c_str(), filename.c_str()) != 0, "Couldn't rename " + tmp);
+}
+
+std::string sketch_file(const std::string & filter_file) {
+    return filter_file + ".sketch";
+}
+
+// sidecars are always saved after their filter, so equal times (the file
+// system's clock is coarser than its timestamps) still count as current
+bool sketch_current(const std::string & filter_file) {
+    return !file_newer(filter_file, sketch_file(filter_file));
+}
@@ -0,0 +1,48 @@
+#ifndef SKETCH_H
+#define SKETCH_H
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+// when true, insertion chooses children by sketch similarity and every
+// union keeps the sketches of the nodes it touches up to date
+extern bool SKETCH_ENABLED;
+
+// number of minimum hash values kept per sketch
+extern std::size_t SKETCH_SIZE;
+
+// a bottom-k MinHash sketch of the positions of the set bits of a filter:
+// the k smallest values of a hash of those positions. Two sketches estimate
+// the overlap of their filters without either filter being in memory.
+class Sketch {
+public:
+    Sketch(std::size_t k = SKETCH_SIZE, uint64_t nbits = 0);
+
+    void add(uint64_t pos);
+    void merge(const Sketch & other);
+
+    uint64_t nbits() const;
+    double cardinality() const;
+    uint64_t similarity(const Sketch & other, int type) const;
+
+    bool load(const std::string & filename);
+    void save(const std::string & filename) const;
+
+    // the hash values, smallest first
+    const std::vector<uint64_t> & values() const;
+
+private:
+    std::size_t k;
+    uint64_t num_bits;               // size of the sketched filter
+    mutable std::vector<uint64_t> mins;  // a max-heap while adding, then sorted
+    mutable bool sorted;
+};
+
+// name of the sidecar file holding the sketch of the given filter
+std::string sketch_file(const std::string & filter_file);
+
+// true unless the filter has been written since its sidecar was
+bool sketch_current(const std::string & filter_file);
+
+#endif
@@ -0,0 +1,156 @@
+#include "StreamCount.h"
+#include "Kmers.h"
+#include "SeqReader.h"
+#include "util.h"
+
+#include <algorithm>
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <thread>
+
+// sequences handed to a worker at a time, and batches allowed to wait
+static const std::size_t STREAM_BATCH_SIZE = 1024;
+static const std::size_t STREAM_MAX_QUEUED = 4;
+
+CountMin::CountMin(uint64_t nb_counters, unsigned depth) :
+    width(std::max<uint64_t>(1, nb_counters / depth)),
+    depth(depth)
+{
+    counters.resize(width * depth, 0);
+}
+
+uint64_t CountMin::slot(const KmerHash & h, unsigned row) const {
+    return row * width + mix64(h.first + row * 0x9e3779b97f4a7c15ULL + h.second) % width;
+}
+
+unsigned CountMin::estimate(const KmerHash & h) const {
+    unsigned m = MAX_COUNT;
+    for (unsigned r = 0; r < depth; r++) {
+        m = std::min<unsigned>(m, __atomic_load_n(&counters[slot(h, r)], __ATOMIC_RELAXED));
+    }
+    return m;
+}
+
+// add one to the kmer's counter in every row (saturating at 255), then read
+// the estimate back. Every counter has then been raised once per occurrence
+// counted so far, so the estimate is never below the true count, and the
+// thread whose increment finished last sees them all. (Conservative update,
+// raising only the minimum counters, would overestimate less but can't be
+// made to keep that guarantee under concurrent updates.)
+unsigned CountMin::increment(const KmerHash & h) {
+    for (unsigned r = 0; r < depth; r++) {
+        uint8_t* c = &counters[slot(h, r)];
+        uint8_t seen = __atomic_load_n(c, __ATOMIC_RELAXED);
+        while (seen < MAX_COUNT && !__atomic_compare_exchange_n(c, &seen, uint8_t(seen + 1),
+                    true, __ATOMIC_SEQ_CST, __ATOMIC_RELAXED)) { }
+    }
+    unsigned m = MAX_COUNT;
+    for (unsigned r = 0; r < depth; r++) {
+        m = std::min<unsigned>(m, __atomic_load_n(&counters[slot(h, r)], __ATOMIC_SEQ_CST));
+    }
+    return m;
+}
+
+// call f(thread, mer) for every kmer in the FASTA/FASTQ file (possibly
+// gzipped), on num_threads worker threads numbered from 0. The file is parsed
+// on this thread and handed out in batches of sequences; returns the number
+// of sequences read.
+uint64_t stream_kmers(
+    const std::string & infilen,
+    int num_threads,
+    const std::function<void(int, const jellyfish::mer_dna &)> & f
+    ) {
+    SeqReader reader(infilen);
+    DIE_IF(!reader.good(), "Couldn't open " + infilen);
+
+    std::mutex lock;
+    std::condition_variable changed;
+    std::deque<std::vector<std::string> > queue;
+    bool finished = false;
+
+    auto worker = [&](int t) {
+        while (true) {
+            std::vector<std::string> batch;
+            {
+                std::unique_lock<std::mutex> g(lock);
+                changed.wait(g, [&]() { return finished || !queue.empty(); });
+                if (queue.empty()) return;
+                batch.swap(queue.front());
+                queue.pop_front();
+            }
+            changed.notify_all();
+
+            for (const auto & seq : batch) {
+                for_each_kmer(seq, [&](const jellyfish::mer_dna & m) { f(t, m); });
+            }
+        }
+    };
+    std::vector<std::thread> threads;
+    for (int t = 0; t < std::max(1, num_threads); t++) {
+        threads.emplace_back(worker, t);
+    }
+
+    std::string name, seq;
+    std::vector<std::string> batch;
+    uint64_t nseqs = 0;
+    bool more = true;
+    while (more) {
+        more = reader.next(name, seq);
+        if (more) {
+            batch.emplace_back(std::move(seq));
+            nseqs++;
+        }
+        if (batch.size() == STREAM_BATCH_SIZE || (!more && !batch.empty())) {
+            std::unique_lock<std::mutex> g(lock);
+            changed.wait(g, [&]() { return queue.size() < STREAM_MAX_QUEUED; });
+            queue.emplace_back();
+            queue.back().swap(batch);
+            changed.notify_all();
+        }
+    }
+    {
+        std::lock_guard<std::mutex> g(lock);
+        finished = true;
+    }
+    changed.notify_all();
+    for (auto & th : threads) {
+        th.join();
+    }
+    return nseqs;
+}
+
+// build a filter from a FASTA/FASTQ file (possibly gzipped) without holding
+// every distinct kmer: each kmer is counted in a count-min sketch, and added
+// to the filter once its estimated count reaches cutoff_count (by whichever
+// thread sees it get there). The sketch
+// uses bf_size / 2 bytes (four times the filter), so memory is set by the
+// filter size, not by the number of distinct kmers in the sample. Since
+// estimates are never low, every kmer seen cutoff_count times is kept;
+// collisions may also keep a few that were seen fewer times.
+bool stream_count(
+    const std::string & infilen,
+    const std::string & outfilen,
+    HashPair hp,
+    int nh,
+    uint64_t bf_size,
+    int num_threads,
+    unsigned cutoff_count
+    ) {
+    DIE_IF(cutoff_count > CountMin::MAX_COUNT, "Streamed counts stop at "
+        + std::to_string(CountMin::MAX_COUNT) + "; use a lower cutoff");
+    UncompressedBF bf(outfilen, hp, nh, bf_size);
+    CountMin counts(cutoff_count > 1 ? std::max<uint64_t>(1 << 20, bf_size / 2) : 0);
+
+    uint64_t nseqs = stream_kmers(infilen, num_threads,
+        [&](int, const jellyfish::mer_dna & m) {
+            KmerHash h = hash_kmer(hp, m);
+            if (cutoff_count <= 1 || counts.increment(h) >= cutoff_count) {
+                bf.add_concurrent(h);
+            }
+        });
+
+    std::cerr << "Streamed " << nseqs << " sequences from " << infilen << std::endl;
+    bf.save();
+    return true;
+}
@@ -0,0 +1,49 @@
+#ifndef STREAMCOUNT_H
+#define STREAMCOUNT_H
+
+#include "BF.h"
+#include <functional>
+#include <string>
+#include <vector>
+
+#include <jellyfish/mer_dna.hpp>
+
+// approximate kmer counts in a fixed amount of memory: a count-min sketch
+// with 8-bit saturating counters. Estimates are never below the true count,
+// even with increment() called from several threads at once.
+class CountMin {
+public:
+    CountMin(uint64_t nb_counters, unsigned depth = 4);
+
+    // counts saturate here, so no estimate is ever higher
+    static const unsigned MAX_COUNT = 255;
+
+    // count one more occurrence; returns the estimated count so far
+    unsigned increment(const KmerHash & h);
+    unsigned estimate(const KmerHash & h) const;
+
+private:
+    uint64_t slot(const KmerHash & h, unsigned row) const;
+
+    std::vector<uint8_t> counters;
+    uint64_t width;
+    unsigned depth;
+};
+
+uint64_t stream_kmers(
+    const std::string & infilen,
+    int num_threads,
+    const std::function<void(int, const jellyfish::mer_dna &)> & f
+    );
+
+bool stream_count(
+    const std::string & infilen,
+    const std::string & outfilen,
+    HashPair hp,
+    int nh,
+    uint64_t bf_size,
+    int num_threads = 16,
+    unsigned cutoff_count = 3
+    );
+
+#endif
@@ -0,0 +1,159 @@
+#include "Synth.h"
+#include "BF.h"
+#include "BloomTree.h"
+#include "util.h"
+
+#include <atomic>
+#include <cmath>
+#include <fstream>
+#include <random>
+#include <thread>
+#include <vector>
+#include <sys/stat.h>
+
+/* A synthetic collection is generated from a balanced binary "phylogeny"
+   over the leaves. Every clade (a node of that hierarchy) owns a random DNA
+   segment, and a leaf contains the kmers of the segments of every clade on
+   its path from the root plus a segment unique to it. Leaves that share a
+   deeper clade therefore share more kmers.
+
+   Segments are regenerated on demand from a seed derived from the clade, so
+   nothing but the current leaf's filter has to be held in memory.
+*/
+
+static const std::size_t SYNTH_QUERY_LEN = 200;
+
+namespace {
+
+struct Phylogeny {
+    unsigned nb_leaves;
+    unsigned depth;             // number of shared levels
+    std::size_t shared_len;     // kmers per shared segment
+    std::size_t unique_len;     // kmers per unique segment
+
+    // the clade at level d containing leaf i; level `depth` is the leaf itself
+    uint64_t clade(unsigned d, unsigned i) const {
+        return (d == depth) ? i : (i >> (depth - d));
+    }
+
+    std::size_t segment_kmers(unsigned d) const {
+        return (d == depth) ? unique_len : shared_len;
+    }
+
+    // the DNA of a clade's segment (segment_kmers(d) kmers long)
+    std::string segment(unsigned d, uint64_t c) const {
+        static const char* bases = "ACGT";
+        std::mt19937_64 rng((uint64_t(d) << 48) ^ (c * 0x9E3779B97F4A7C15ULL));
+        std::string s(segment_kmers(d) + jellyfish::mer_dna::k() - 1, 'A');
+        for (auto & b : s) b = bases[rng() & 3];
+        return s;
+    }
+};
+
+std::string leaf_name(const std::string & outdir, unsigned i) {
+    return outdir + "/leaf" + std::to_string(i) + ".bf.bv";
+}
+
+void add_segment(UncompressedBF & bf, const std::string & seg) {
+    const unsigned k = jellyfish::mer_dna::k();
+    if (seg.size() < k) return;
+    jellyfish::mer_dna m(seg.substr(0, k));
+    bf.add(m);
+    for (std::size_t i = k; i < seg.size(); i++) {
+        m.shift_left(seg[i]);
+        bf.add(m);
+    }
+}
+
+} // namespace
+
+// write nb_leaves leaf filters of bf_size bits with about the given fill
+// ratio, of which unique_frac of each leaf's kmers are its own, along with
+// the list of filters, a query file and the true answers to those queries
+void synth_collection(
+    const std::string & hashes_file,
+    uint64_t bf_size,
+    unsigned nb_leaves,
+    const std::string & outdir,
+    double fill,
+    double unique_frac,
+    unsigned nb_queries,
+    unsigned num_threads
+) {
+    DIE_IF(nb_leaves == 0, "Need at least one leaf");
+    DIE_IF(fill <= 0 || fill >= 1, "Fill ratio must be in (0, 1)");
+    DIE_IF(unique_frac < 0 || unique_frac > 1, "Unique fraction must be in [0, 1]");
+
+    int nh = 0;
+    HashPair* hashes = get_hash_function(hashes_file, nh);
+
+    // a filter with h hashes and n kmers has fill 1 - exp(-h n / m)
+    double kmers_per_leaf = -double(bf_size) / nh * std::log(1 - fill);
+
+    Phylogeny phy;
+    phy.nb_leaves = nb_leaves;
+    phy.depth = unsigned(std::ceil(std::log2(double(nb_leaves))));
+    phy.unique_len = std::max<std::size_t>(SYNTH_QUERY_LEN, unique_frac * kmers_per_leaf);
+    phy.shared_len = (phy.depth == 0) ? 0 : std::max<std::size_t>(SYNTH_QUERY_LEN,
+        (1 - unique_frac) * kmers_per_leaf / phy.depth);
+
+    std::cerr << "Generating " << nb_leaves << " leaves with " << phy.depth
+        << " shared levels of " << phy.shared_len << " kmers and "
+        << phy.unique_len << " unique kmers each" << std::endl;
+
+    mkdir(outdir.c_str(), 0755);
+
+    // build the leaves in parallel, one filter per thread at a time
+    std::atomic<unsigned> next(0);
+    auto worker = [&]() {
+        unsigned i;
+        while ((i = next++) < nb_leaves) {
+            UncompressedBF bf(leaf_name(outdir, i), *hashes, nh, bf_size);
+            for (unsigned d = 0; d <= phy.depth; d++) {
+                add_segment(bf, phy.segment(d, phy.clade(d, i)));
+            }
+            bf.save();
+        }
+    };
+    std::vector<std::thread> threads;
+    for (unsigned t = 1; t < std::max(1u, num_threads); t++) {
+        threads.emplace_back(worker);
+    }
+    worker();
+    for (auto & t : threads) {
+        t.join();
+    }
+
+    std::ofstream list(outdir + "/filters.txt");
+    for (unsigned i = 0; i < nb_leaves; i++) {
+        list << leaf_name(outdir, i) << std::endl;
+    }
+
+    // each query is a substring of one clade's segment; its true answer is
+    // every leaf in the clade. Filters can add false positives on top.
+    std::mt19937_64 rng(nb_leaves);
+    std::ofstream queries(outdir + "/queries.txt");
+    std::ofstream truth(outdir + "/truth.txt");
+    for (unsigned q = 0; q < nb_queries; q++) {
+        unsigned d = rng() % (phy.depth + 1);
+        unsigned leaf = rng() % nb_leaves;
+        uint64_t c = phy.clade(d, leaf);
+        std::string seg = phy.segment(d, c);
+        std::string query = seg.substr(rng() % (seg.size() - SYNTH_QUERY_LEN + 1), SYNTH_QUERY_LEN);
+
+        std::vector<unsigned> members;
+        for (unsigned i = 0; i < nb_leaves; i++) {
+            if (phy.clade(d, i) == c) members.push_back(i);
+        }
+
+        queries << query << std::endl;
+        truth << "*" << query << " " << members.size() << std::endl;
+        for (auto i : members) {
+            truth << leaf_name(outdir, i) << std::endl;
+        }
+    }
+
+    std::cerr << "Wrote " << outdir << "/filters.txt, " << outdir << "/queries.txt and "
+        << outdir << "/truth.txt" << std::endl;
+    delete hashes;
+}
@@ -0,0 +1,18 @@
+#ifndef SYNTH_H
+#define SYNTH_H
+
+#include <string>
+#include <cstdint>
+
+void synth_collection(
+    const std::string & hashes_file,
+    uint64_t bf_size,
+    unsigned nb_leaves,
+    const std::string & outdir,
+    double fill,
+    double unique_frac,
+    unsigned nb_queries,
+    unsigned num_threads
+);
+
+#endif
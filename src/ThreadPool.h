@@ -0,0 +1,74 @@
+#ifndef THREADPOOL_H
+#define THREADPOOL_H
+
+#include <condition_variable>
+#include <functional>
+#include <future>
+#include <memory>
+#include <mutex>
+#include <queue>
+#include <thread>
+#include <vector>
+
+// a fixed set of worker threads that run submitted tasks in the order they
+// were submitted. The destructor finishes the queued tasks before joining.
+class ThreadPool {
+public:
+    explicit ThreadPool(unsigned nb_threads) : stopping(false) {
+        if (nb_threads == 0) nb_threads = 1;
+        for (unsigned i = 0; i < nb_threads; i++) {
+            workers.emplace_back([this]() { work(); });
+        }
+    }
+
+    ~ThreadPool() {
+        {
+            std::lock_guard<std::mutex> g(lock);
+            stopping = true;
+        }
+        wake.notify_all();
+        for (auto & w : workers) {
+            w.join();
+        }
+    }
+
+    ThreadPool(const ThreadPool &) = delete;
+    ThreadPool & operator=(const ThreadPool &) = delete;
+
+    // queue f() to run on a worker; the future is ready when it has run
+    // (and rethrows anything it threw)
+    template <typename F>
+    std::future<void> submit(F f) {
+        auto task = std::make_shared<std::packaged_task<void()> >(f);
+        std::future<void> done = task->get_future();
+        {
+            std::lock_guard<std::mutex> g(lock);
+            tasks.emplace([task]() { (*task)(); });
+        }
+        wake.notify_one();
+        return done;
+    }
+
+private:
+    void work() {
+        while (true) {
+            std::function<void()> task;
+            {
+                std::unique_lock<std::mutex> g(lock);
+                wake.wait(g, [this]() { return stopping || !tasks.empty(); });
+                if (tasks.empty()) return;
+                task = std::move(tasks.front());
+                tasks.pop();
+            }
+            task();
+        }
+    }
+
+    std::vector<std::thread> workers;
+    std::queue<std::function<void()> > tasks;
+    std::mutex lock;
+    std::condition_variable wake;
+    bool stopping;
+};
+
+#endif
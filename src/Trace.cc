@@ -0,0 +1,171 @@
+#include "Trace.h"
+#include "util.h"
+
+#include <map>
+#include <mutex>
+#include <vector>
+#include <fstream>
+
+bool TRACE_ENABLED = false;
+
+namespace {
+
+struct NodeTrace {
+    uint64_t probes = 0;        // (query, node) tests
+    uint64_t kmers_probed = 0;
+    double hits = 0;
+    uint64_t passed = 0;
+    uint64_t pruned = 0;
+    uint64_t cache_hits = 0;
+    uint64_t cache_misses = 0;
+    uint64_t bytes_loaded = 0;
+    double load_secs = 0;
+    double probe_secs = 0;
+};
+
+struct QueryTrace {
+    uint64_t kmers = 0;
+    uint64_t nodes_visited = 0;
+    uint64_t nodes_passed = 0;
+    uint64_t kmers_probed = 0;
+    double hits = 0;
+    double hash_secs = 0;
+    double probe_secs = 0;
+    uint64_t cache_hits = 0;    // nodes visited whose filter was loaded
+    uint64_t cache_misses = 0;
+    double bytes_loaded = 0;    // this query's share of the loads
+    double load_secs = 0;
+};
+
+std::mutex trace_lock;
+std::map<std::string, NodeTrace> node_traces;
+std::vector<QueryTrace> query_traces;
+
+QueryTrace & query_trace(std::size_t id) {
+    if (id >= query_traces.size()) query_traces.resize(id + 1);
+    return query_traces[id];
+}
+
+std::string json_string(const std::string & s) {
+    std::string out = "\"";
+    for (char c : s) {
+        if (c == '"' || c == '\\') out += '\\';
+        out += c;
+    }
+    return out + "\"";
+}
+
+} // namespace
+
+double seconds_since(TraceClock::time_point start) {
+    return std::chrono::duration<double>(TraceClock::now() - start).count();
+}
+
+void trace_visit(const std::string & node, const std::vector<std::size_t> & queries,
+    bool hit, uint64_t bytes, double secs) {
+    std::lock_guard<std::mutex> g(trace_lock);
+    // misses are counted for the node by trace_load()
+    if (hit) node_traces[node].cache_hits++;
+    if (queries.empty()) return;
+
+    double share_bytes = double(bytes) / queries.size();
+    double share_secs = secs / queries.size();
+    for (std::size_t id : queries) {
+        QueryTrace & q = query_trace(id);
+        if (hit) {
+            q.cache_hits++;
+        } else {
+            q.cache_misses++;
+            q.bytes_loaded += share_bytes;
+            q.load_secs += share_secs;
+        }
+    }
+}
+
+void trace_load(const std::string & node, uint64_t bytes, double secs) {
+    std::lock_guard<std::mutex> g(trace_lock);
+    NodeTrace & t = node_traces[node];
+    t.cache_misses++;
+    t.bytes_loaded += bytes;
+    t.load_secs += secs;
+}
+
+void trace_hash(std::size_t query, uint64_t kmers, double secs) {
+    std::lock_guard<std::mutex> g(trace_lock);
+    QueryTrace & t = query_trace(query);
+    t.kmers = kmers;
+    t.hash_secs += secs;
+}
+
+void trace_probe(const std::string & node, std::size_t query, uint64_t kmers, double hits, double secs) {
+    std::lock_guard<std::mutex> g(trace_lock);
+    NodeTrace & n = node_traces[node];
+    n.probes++;
+    n.kmers_probed += kmers;
+    n.hits += hits;
+    n.probe_secs += secs;
+
+    QueryTrace & q = query_trace(query);
+    q.nodes_visited++;
+    q.kmers_probed += kmers;
+    q.hits += hits;
+    q.probe_secs += secs;
+}
+
+void trace_decision(const std::string & node, std::size_t query, bool passed) {
+    std::lock_guard<std::mutex> g(trace_lock);
+    NodeTrace & n = node_traces[node];
+    if (passed) {
+        n.passed++;
+        query_trace(query).nodes_passed++;
+    } else {
+        n.pruned++;
+    }
+}
+
+// write everything recorded so far as JSON:
+//   {"nodes": [{"name": ..., ...}, ...], "queries": [{"id": ..., ...}, ...]}
+void write_trace(const std::string & filename) {
+    std::lock_guard<std::mutex> g(trace_lock);
+    std::ofstream out(filename);
+    DIE_IF(!out, "Couldn't open trace file " + filename);
+
+    out << "{\n\"nodes\": [";
+    bool first = true;
+    for (const auto & p : node_traces) {
+        const NodeTrace & t = p.second;
+        out << (first ? "\n" : ",\n")
+            << "  {\"name\": " << json_string(p.first)
+            << ", \"probes\": " << t.probes
+            << ", \"kmers_probed\": " << t.kmers_probed
+            << ", \"hits\": " << t.hits
+            << ", \"passed\": " << t.passed
+            << ", \"pruned\": " << t.pruned
+            << ", \"cache_hits\": " << t.cache_hits
+            << ", \"cache_misses\": " << t.cache_misses
+            << ", \"bytes_loaded\": " << t.bytes_loaded
+            << ", \"load_secs\": " << t.load_secs
+            << ", \"probe_secs\": " << t.probe_secs << "}";
+        first = false;
+    }
+    out << "\n],\n\"queries\": [";
+    for (std::size_t i = 0; i < query_traces.size(); i++) {
+        const QueryTrace & t = query_traces[i];
+        out << (i == 0 ? "\n" : ",\n")
+            << "  {\"id\": " << i
+            << ", \"kmers\": " << t.kmers
+            << ", \"nodes_visited\": " << t.nodes_visited
+            << ", \"nodes_passed\": " << t.nodes_passed
+            << ", \"kmers_probed\": " << t.kmers_probed
+            << ", \"hits\": " << t.hits
+            << ", \"hash_secs\": " << t.hash_secs
+            << ", \"probe_secs\": " << t.probe_secs
+            << ", \"cache_hits\": " << t.cache_hits
+            << ", \"cache_misses\": " << t.cache_misses
+            << ", \"bytes_loaded\": " << t.bytes_loaded
+            << ", \"load_secs\": " << t.load_secs << "}";
+    }
+    out << "\n]\n}" << std::endl;
+    std::cerr << "Wrote trace for " << node_traces.size() << " nodes and "
+        << query_traces.size() << " queries to " << filename << std::endl;
+}
@@ -0,0 +1,30 @@
+#ifndef TRACE_H
+#define TRACE_H
+
+#include <chrono>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+// when false (the default), the trace_* functions are never called from the
+// query engine and tracing costs one branch per event site.
+extern bool TRACE_ENABLED;
+
+using TraceClock = std::chrono::steady_clock;
+double seconds_since(TraceClock::time_point start);
+
+// record events for a node (by filter name) and/or query (by id). All of
+// these are safe to call from several threads.
+// trace_visit() records one visit of a node by a batch of queries: a cache
+// hit for the node if its filter was already loaded, and for each query a hit
+// or miss plus an equal share of the bytes and time of any load.
+void trace_visit(const std::string & node, const std::vector<std::size_t> & queries,
+    bool hit, uint64_t bytes, double secs);
+void trace_load(const std::string & node, uint64_t bytes, double secs);
+void trace_hash(std::size_t query, uint64_t kmers, double secs);
+void trace_probe(const std::string & node, std::size_t query, uint64_t kmers, double hits, double secs);
+void trace_decision(const std::string & node, std::size_t query, bool passed);
+
+void write_trace(const std::string & filename);
+
+#endif
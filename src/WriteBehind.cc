@@ -0,0 +1,149 @@
+#include "WriteBehind.h"
+#include "BF.h"
+
+#include <chrono>
+#include <condition_variable>
+#include <map>
+#include <mutex>
+#include <thread>
+
+double WRITE_BEHIND_INTERVAL = 5.0;
+
+// at most this many evicted filters wait to be written; beyond that,
+// eviction blocks and the writer stops waiting out the interval
+static const std::size_t WRITE_BEHIND_MAX_PENDING = 8;
+
+namespace {
+
+using Clock = std::chrono::steady_clock;
+
+class Writer {
+public:
+    Writer() : flushes(0), stopping(false) {}
+
+    // write everything still pending before exit
+    ~Writer() {
+        {
+            std::lock_guard<std::mutex> g(lock);
+            if (!thread.joinable()) return;
+            stopping = true;
+        }
+        wake.notify_all();
+        thread.join();
+    }
+
+    void submit(const std::string & filename, BF* bf, std::function<void()> then) {
+        std::unique_lock<std::mutex> g(lock);
+        if (!thread.joinable()) {
+            thread = std::thread([this]() { run(); });
+        }
+        wake.notify_all();
+        written.wait(g, [&]() {
+            return pending.count(filename) != 0 || pending.size() < WRITE_BEHIND_MAX_PENDING;
+        });
+        // a newer copy of a filter replaces the one still waiting
+        auto it = pending.find(filename);
+        if (it != pending.end()) delete it->second.bf;
+        pending[filename] = Pending{bf, Clock::now(), then};
+        wake.notify_all();
+    }
+
+    // take back a filter that hasn't been written yet; if it is being
+    // written, wait for that, and return nullptr so it is read from disk
+    BF* reclaim(const std::string & filename) {
+        std::unique_lock<std::mutex> g(lock);
+        written.wait(g, [&]() { return writing != filename; });
+        auto it = pending.find(filename);
+        if (it == pending.end()) return nullptr;
+        BF* bf = it->second.bf;
+        pending.erase(it);
+        written.notify_all();
+        return bf;
+    }
+
+    // write everything now, and wait until it is on disk
+    void flush() {
+        std::unique_lock<std::mutex> g(lock);
+        flushes++;
+        wake.notify_all();
+        written.wait(g, [this]() { return pending.empty() && writing.empty(); });
+        flushes--;
+    }
+
+private:
+    struct Pending {
+        BF* bf;
+        Clock::time_point since;
+        std::function<void()> then;
+    };
+
+    void run() {
+        std::unique_lock<std::mutex> g(lock);
+        while (true) {
+            if (pending.empty()) {
+                if (stopping) return;
+                wake.wait(g);
+                continue;
+            }
+
+            auto oldest = pending.begin();
+            for (auto it = pending.begin(); it != pending.end(); ++it) {
+                if (it->second.since < oldest->second.since) oldest = it;
+            }
+            auto due = oldest->second.since + std::chrono::duration_cast<Clock::duration>(
+                std::chrono::duration<double>(WRITE_BEHIND_INTERVAL));
+            bool hurry = stopping || flushes > 0 || pending.size() >= WRITE_BEHIND_MAX_PENDING;
+            if (!hurry && Clock::now() < due) {
+                wake.wait_until(g, due);
+                continue;
+            }
+
+            writing = oldest->first;
+            BF* bf = oldest->second.bf;
+            std::function<void()> then = oldest->second.then;
+            pending.erase(oldest);
+            g.unlock();
+            bf->save();
+            delete bf;
+            if (then) then();
+            g.lock();
+            writing.clear();
+            written.notify_all();
+        }
+    }
+
+    std::mutex lock;
+    std::condition_variable wake;     // for the writer thread
+    std::condition_variable written;  // for threads waiting on the writer
+    std::map<std::string, Pending> pending;
+    std::string writing;
+    int flushes;
+    bool stopping;
+    std::thread thread;
+};
+
+Writer writer;
+
+} // namespace
+
+// take ownership of a dirty filter, and save and free it later
+void write_behind(const std::string & filename, BF* bf, std::function<void()> then) {
+    if (WRITE_BEHIND_INTERVAL <= 0) {
+        bf->save();
+        delete bf;
+        if (then) then();
+        return;
+    }
+    writer.submit(filename, bf, then);
+}
+
+// the filter for filename if it is still waiting to be written (the caller
+// owns it again, and it is still dirty), otherwise nullptr once the file on
+// disk is up to date
+BF* reclaim_write(const std::string & filename) {
+    return writer.reclaim(filename);
+}
+
+void flush_writes() {
+    writer.flush();
+}
@@ -0,0 +1,21 @@
+#ifndef WRITEBEHIND_H
+#define WRITEBEHIND_H
+
+#include <functional>
+#include <string>
+
+class BF;
+
+// dirty filters evicted from the node cache are written by a background
+// thread, at the earliest this many seconds after eviction. A filter that is
+// reloaded before then is handed back without touching the disk, so a hot
+// node is written at most once per interval. 0 writes synchronously.
+extern double WRITE_BEHIND_INTERVAL;
+
+// then, if given, runs once the filter is on disk; it is dropped along with
+// the filter if that is reclaimed first.
+void write_behind(const std::string & filename, BF* bf, std::function<void()> then = nullptr);
+BF* reclaim_write(const std::string & filename);
+void flush_writes();
+
+#endif
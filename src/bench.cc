@@ -0,0 +1,277 @@
+// Offline benchmarks for the hot kernels and the main end-to-end paths, run
+// on synthetic data. Build with `make bench` and run `./bench [scale]`; scale
+// (default 1) multiplies the filter sizes and the number of leaves.
+
+#include "BF.h"
+#include "BloomTree.h"
+#include "Build.h"
+#include "Query.h"
+#include "util.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdlib>
+#include <fstream>
+#include <random>
+#include <sstream>
+#include <sys/resource.h>
+#include <unistd.h>
+
+#include <jellyfish/file_header.hpp>
+
+using Clock = std::chrono::steady_clock;
+
+static std::mt19937_64 rng(20150101);
+static std::string bench_dir;
+
+double elapsed(Clock::time_point start) {
+    return std::chrono::duration<double>(Clock::now() - start).count();
+}
+
+// peak resident set size of this process so far, in MB
+double peak_rss_mb() {
+    struct rusage ru;
+    getrusage(RUSAGE_SELF, &ru);
+    return ru.ru_maxrss / 1024.0;
+}
+
+// summary of a set of latency samples (seconds)
+std::string percentiles(std::vector<double> v) {
+    std::sort(v.begin(), v.end());
+    auto at = [&](double p) { return v[std::min(v.size() - 1, std::size_t(p * v.size()))]; };
+    std::ostringstream oss;
+    oss << "p50=" << at(0.50) * 1e6 << "us p95=" << at(0.95) * 1e6
+        << "us p99=" << at(0.99) * 1e6 << "us";
+    return oss.str();
+}
+
+void report(const std::string & name, const std::string & params, double throughput,
+    const std::string & unit, const std::vector<double> & latencies) {
+    std::cout << name << "\t" << params << "\t" << throughput << " " << unit;
+    if (!latencies.empty()) std::cout << "\t" << percentiles(latencies);
+    std::cout << "\tpeak_rss=" << peak_rss_mb() << "MB" << std::endl;
+}
+
+std::string random_dna(std::size_t len) {
+    static const char* bases = "ACGT";
+    std::string s(len, 'A');
+    for (auto & c : s) c = bases[rng() & 3];
+    return s;
+}
+
+// write a hash file, as `bt hashes` does
+std::string write_hashes(HashPair & hp, int nh) {
+    std::string fn = bench_dir + "/hashes_" + std::to_string(nh) + ".hh";
+    jellyfish::file_header fh;
+    fh.matrix(hp.m1, 1);
+    fh.matrix(hp.m2, 2);
+    fh.key_len(jellyfish::mer_dna::k() * 2);
+    fh.nb_hashes(nh);
+    std::ofstream out(fn.c_str());
+    fh.write(out);
+    return fn;
+}
+
+// an uncompressed filter holding the kmers of a random sequence long enough
+// to reach the given fill ratio
+UncompressedBF* make_filter(const std::string & fn, const HashPair & hp, int nh,
+    uint64_t bits, double fill, std::string * seq = nullptr) {
+    UncompressedBF* bf = new UncompressedBF(fn, hp, nh, bits);
+    std::size_t nkmers = std::size_t(-double(bits) / nh * std::log(1 - fill));
+    std::string s = random_dna(nkmers + jellyfish::mer_dna::k() - 1);
+    for (std::size_t i = 0; i < nkmers; i++) {
+        bf->add(jellyfish::mer_dna(s.substr(i, jellyfish::mer_dna::k())));
+    }
+    if (seq != nullptr) *seq = s;
+    return bf;
+}
+
+sdsl::bit_vector random_bits(uint64_t bits, double fill) {
+    sdsl::bit_vector bv(bits, 0);
+    uint64_t* d = bv.data();
+    for (uint64_t w = 0; w < (bits >> 6); w++) {
+        uint64_t word = 0;
+        for (int b = 0; b < 64; b++) {
+            if (std::generate_canonical<double, 53>(rng) < fill) word |= 1ULL << b;
+        }
+        d[w] = word;
+    }
+    return bv;
+}
+
+/*** microbenchmarks ***/
+
+void bench_contains(HashPair & hp, uint64_t bits, int nh) {
+    std::string fn = bench_dir + "/contains.bf.bv";
+    std::string inserted;
+    UncompressedBF* ubf = make_filter(fn, hp, nh, bits, 0.1, &inserted);
+    ubf->save();
+    ubf->compress();
+    BF* rrr = load_bf_from_file(fn + ".rrr", hp, nh);
+    rrr->load();
+
+    // alternate probes hit (kmers taken from what was inserted, so every
+    // hash is tested) and (mostly) miss (random kmers, which usually stop at
+    // the first clear bit)
+    const std::size_t k = jellyfish::mer_dna::k();
+    std::uniform_int_distribution<std::size_t> pos(0, inserted.size() - k);
+    std::vector<jellyfish::mer_dna> kmers;
+    for (int i = 0; i < 100000; i++) {
+        if (i % 2 == 0) {
+            kmers.emplace_back(inserted.substr(pos(rng), k));
+        } else {
+            kmers.emplace_back(random_dna(k));
+        }
+    }
+    std::vector<KmerHash> hashed;
+    for (const auto & m : kmers) hashed.emplace_back(hash_kmer(hp, m));
+
+    const BF* backends[] = {ubf, rrr};
+    const char* names[] = {"bit_vector", "rrr_vector<255>"};
+    for (int b = 0; b < 2; b++) {
+        std::ostringstream params;
+        params << "backend=" << names[b] << " bits=" << bits << " hashes=" << nh;
+
+        // latency samples are per block of 1000 probes
+        std::vector<double> lat;
+        std::size_t found = 0;
+        auto start = Clock::now();
+        for (std::size_t i = 0; i < hashed.size(); i += 1000) {
+            auto t = Clock::now();
+            for (std::size_t j = i; j < i + 1000; j++) found += backends[b]->contains(hashed[j]);
+            lat.push_back(elapsed(t) / 1000);
+        }
+        report("contains", params.str(), hashed.size() / elapsed(start), "probes/s", lat);
+
+        start = Clock::now();
+        for (const auto & m : kmers) found += backends[b]->contains(m);
+        report("hash+contains", params.str(), kmers.size() / elapsed(start), "probes/s", {});
+        if (found == 0) std::cerr << "(no hits)" << std::endl;
+    }
+    delete ubf;
+    delete rrr;
+}
+
+void bench_union(uint64_t bits) {
+    sdsl::bit_vector a = random_bits(bits, 0.1), b = random_bits(bits, 0.1);
+    std::vector<double> lat;
+    auto start = Clock::now();
+    for (int i = 0; i < 5; i++) {
+        auto t = Clock::now();
+        delete union_bv_fast(a, b);
+        lat.push_back(elapsed(t));
+    }
+    report("union_bv_fast", "bits=" + std::to_string(bits),
+        5 * 2 * (bits / 8) / elapsed(start) / 1e6, "MB/s", lat);
+}
+
+void bench_similarity(HashPair & hp, uint64_t bits) {
+    UncompressedBF* a = make_filter(bench_dir + "/a.bf.bv", hp, 1, bits, 0.1);
+    UncompressedBF* b = make_filter(bench_dir + "/b.bf.bv", hp, 1, bits, 0.1);
+    for (int type = 0; type < 2; type++) {
+        std::vector<double> lat;
+        auto start = Clock::now();
+        for (int i = 0; i < 5; i++) {
+            auto t = Clock::now();
+            a->similarity(b, type);
+            lat.push_back(elapsed(t));
+        }
+        std::ostringstream params;
+        params << "bits=" << bits << " type=" << type;
+        report("similarity", params.str(), 5 * 2 * (bits / 8) / elapsed(start) / 1e6, "MB/s", lat);
+    }
+    delete a;
+    delete b;
+}
+
+/*** end-to-end scenarios ***/
+
+// build a tree of nleaves synthetic leaves; returns the tree file and fills
+// in the leaf sequences (for drawing queries from)
+std::string bench_build(HashPair & hp, uint64_t bits, int nleaves, std::vector<std::string> & seqs) {
+    std::string hashes_file = write_hashes(hp, 1);
+    std::vector<std::string> leaves;
+    for (int i = 0; i < nleaves; i++) {
+        std::string fn = bench_dir + "/leaf" + std::to_string(i) + ".bf.bv";
+        std::string seq;
+        UncompressedBF* bf = make_filter(fn, hp, 1, bits, 0.05, &seq);
+        bf->save();
+        delete bf;
+        leaves.push_back(fn);
+        seqs.push_back(seq);
+    }
+
+    std::string tree_file = bench_dir + "/tree.txt";
+    auto start = Clock::now();
+    dynamic_build(hashes_file, leaves, tree_file, 0);
+    double secs = elapsed(start);
+    report("dynamic_build", "leaves=" + std::to_string(nleaves) + " bits=" + std::to_string(bits),
+        nleaves / secs, "leaves/s", {secs});
+    return tree_file;
+}
+
+void bench_query(const std::string & tree_file, const std::vector<std::string> & seqs) {
+    const std::size_t qlen = 200;
+    BloomTree* root = read_bloom_tree(tree_file);
+
+    for (std::size_t batch : {1, 10, 100, 1000}) {
+        // each query is a substring of a random leaf's sequence
+        std::string qfile = bench_dir + "/queries.txt";
+        {
+            std::ofstream q(qfile);
+            for (std::size_t i = 0; i < batch; i++) {
+                const std::string & s = seqs[rng() % seqs.size()];
+                q << s.substr(rng() % (s.size() - qlen), qlen) << std::endl;
+            }
+        }
+
+        // cold runs start with an empty node cache (the OS page cache may
+        // still hold the files); warm runs follow a run of the same batch
+        for (const char* state : {"cold", "warm"}) {
+            bool cold = std::string(state) == "cold";
+            std::ostringstream devnull;
+            std::vector<double> lat;
+            double total = 0;
+            for (int rep = 0; rep < 3; rep++) {
+                if (cold) BloomTree::clear_cache();
+                auto t = Clock::now();
+                batch_query_from_file(root, qfile, devnull);
+                lat.push_back(elapsed(t));
+                total += lat.back();
+            }
+            std::ostringstream params;
+            params << "cache=" << state << " batch=" << batch;
+            report("query_batch", params.str(), 3 * batch / total, "queries/s", lat);
+        }
+    }
+}
+
+int main(int argc, char* argv[]) {
+    double scale = (argc > 1) ? atof(argv[1]) : 1.0;
+    DIE_IF(scale <= 0, "Usage: bench [scale]");
+
+    char dir[] = "/tmp/bt_bench_XXXXXX";
+    DIE_IF(mkdtemp(dir) == nullptr, "Couldn't create temporary directory");
+    bench_dir = dir;
+
+    jellyfish::mer_dna::k(20);
+    HashPair hp;
+
+    for (uint64_t bits : {uint64_t(1e6 * scale), uint64_t(64e6 * scale)}) {
+        bits &= ~uint64_t(63);
+        for (int nh : {1, 2, 4}) {
+            bench_contains(hp, bits, nh);
+        }
+        bench_union(bits);
+        bench_similarity(hp, bits);
+    }
+
+    std::vector<std::string> seqs;
+    std::string tree = bench_build(hp, uint64_t(4e6 * scale) & ~uint64_t(63),
+        int(32 * scale), seqs);
+    bench_query(tree, seqs);
+
+    std::system(("rm -rf " + bench_dir).c_str());
+    return 0;
+}
@@ -4,6 +4,16 @@
 #include "BF.h"
 #include "util.h"
 #include "Count.h"
+#include "StreamCount.h"
+#include "Estimate.h"
+#include "Trace.h"
+#include "Synth.h"
+#include "Replay.h"
+#include "PerfCounters.h"
+#include "Sketch.h"
+#include "Cluster.h"
+#include "Optimize.h"
+#include "WriteBehind.h"
 
 #include <string>
 #include <cstdlib>
@@ -17,6 +27,7 @@
 // various commandline filenames
 std::string command;
 std::string bloom_tree_file;
+std::string bloom_tree_file2;
 std::string query_file;
 std::string out_file;
 std::string jfbloom_file;
@@ -27,6 +38,33 @@ int leaf_only;
 std::string weighted="";
 unsigned cutoff_count=3;
 
+// with --cutoff auto, filters are sized for the kmers seen at least twice:
+// the chosen cutoffs aren't known until each sample is counted
+unsigned sizing_cutoff() {
+    return cutoff_count == CUTOFF_AUTO ? 2 : cutoff_count;
+}
+unsigned top_k=0;
+int use_planner=0;
+std::string trace_file="";
+double synth_fill=0.05;
+double synth_unique=0.2;
+unsigned synth_queries=1000;
+unsigned nb_leaves;
+std::string record_file="";
+double replay_speed=1.0;
+int perf_counters=0;
+int cluster_leaves=0;
+int balanced_tree=0;
+std::string compress_out="";
+std::string leaf_name;
+int split_depth=0;
+unsigned checkpoint_every=100;
+int resume_build=0;
+std::string sample_list="";
+int stream_counts=0;
+int auto_size=0;
+int from_jf=0;
+
 std::string hashes_file;
 unsigned nb_hashes;
 uint64_t bf_size;
@@ -34,7 +72,7 @@ uint64_t bf_size;
 unsigned num_threads = 16;
 //unsigned parallel_level = 3; // no parallelism by default
 
-const char * OPTIONS = "t:p:f:l:c:w:s:";
+const char * OPTIONS = "t:p:f:l:c:w:s:b:K:P:T:F:U:Q:R:S:CMABO:D:E:YI:G:L:Xe:ZJ";
 
 static struct option LONG_OPTIONS[] = {
     {"max-filters", required_argument, 0, 'f'},
@@ -45,24 +83,67 @@ static struct option LONG_OPTIONS[] = {
     {"leaf-only", required_argument,0,'l'},
     {"cutoff", required_argument,0,'c'},
     {"weighted", required_argument,0,'w'},
+    {"batch-size", required_argument,0,'b'},
+    {"top-k", required_argument,0,'K'},
+    {"plan", required_argument,0,'P'},
+    {"trace", required_argument,0,'T'},
+    {"fill", required_argument,0,'F'},
+    {"unique", required_argument,0,'U'},
+    {"queries", required_argument,0,'Q'},
+    {"record", required_argument,0,'R'},
+    {"speed", required_argument,0,'S'},
+    {"perf-counters", no_argument,0,'C'},
+    {"sketch", no_argument,0,'M'},
+    {"cluster", no_argument,0,'A'},
+    {"balanced", no_argument,0,'B'},
+    {"compress-out", required_argument,0,'O'},
+    {"split-depth", required_argument,0,'D'},
+    {"checkpoint", required_argument,0,'E'},
+    {"resume", no_argument,0,'Y'},
+    {"flush-interval", required_argument,0,'I'},
+    {"memory", required_argument,0,'G'},
+    {"batch", required_argument,0,'L'},
+    {"stream", no_argument,0,'X'},
+    {"fp-rate", required_argument,0,'e'},
+    {"auto-size", no_argument,0,'Z'},
+    {"from-jf", no_argument,0,'J'},
     {0,0,0,0}
 };
 
 void print_usage() {
     std::cerr 
-        << "Usage: bt [query|convert|build] ...\n"
+        << "Usage: bt [--perf-counters] [query|convert|build] ...\n"
         << "    \"hashes\" [-k 20] hashfile nb_hashes\n"
-        << "    \"count\" [--cutoff 3] [--threads 16] hashfile bf_size fasta_in filter_out.bf.bv\n"
-        << "    \"build\" [--sim-type 0] hashfile filterlistfile outfile\n"
-	    << "    \"compress\" bloomtreefile outfile\n"
+        << "    \"estimate\" [--cutoff 3] [--fp-rate 0.05] [--threads 16] hashfile samplelist\n"
+        << "    \"count\" [--cutoff 3] [--threads 16] [--stream] hashfile bf_size fasta_in filter_out.bf.bv\n"
+        << "    \"count\" [--cutoff 3] [--threads 16] [--stream] [--auto-size] [--fp-rate 0.05] --batch samplelist hashfile bf_size\n"
+        << "    \"count\" [--cutoff 3] [--threads 16] --from-jf hashfile bf_size counts.jf filter_out.bf.bv\n"
+        << "    \"count\" [--cutoff 3] [--threads 16] --from-jf --batch samplelist hashfile bf_size\n"
+        << "            (samplelist has one \"fasta_in [filter_out.bf.bv]\" per line, or one\n"
+        << "             \"counts.jf [filter_out.bf.bv]\" with --from-jf;\n"
+        << "             with --auto-size, bf_size is an upper bound. Every filter in a tree\n"
+        << "             must have the same size: size them together with --batch, or use\n"
+        << "             \"estimate\" over all the samples and a fixed bf_size;\n"
+        << "             with --cutoff auto, each sample's cutoff is picked from its count histogram\n"
+        << "             and recorded with the fill ratio in filter_out.bf.bv.info)\n"
+        << "    \"build\" [--sim-type 0] [--threads 16] [--sketch] [--checkpoint 100] [--resume] [--flush-interval 5] [--cluster] [--balanced] [--compress-out compressedtreefile] [--max-filters 100] hashfile filterlistfile outfile\n"
+        << "    \"insert\" [--sim-type 0] [--sketch] bloomtreefile filterlistfile\n"
+        << "    \"remove\" bloomtreefile leaffilter\n"
+        << "    \"optimize\" bloomtreefile outfile\n"
+        << "    \"merge\" [--split-depth 0] [--sim-type 0] bloomtreefile1 bloomtreefile2 outfile\n"
+	    << "    \"compress\" [--threads 16] [--memory 4096] bloomtreefile outfile\n"
 
         << "    \"check\" bloomtreefile\n"
         << "    \"draw\" bloomtreefile out.dot\n"
 
-        << "    \"query\" [--max-filters 1] [-t 0.8] [-leaf-only 0] [--weighted weightfile] bloomtreefile queryfile outfile\n"
+        << "    \"query\" [--max-filters 1] [-t 0.8] [--threads 16] [-leaf-only 0] [--weighted weightfile] [--batch-size 100000] [--top-k 0] [--plan 0] [--trace out.json] [--record replayfile] bloomtreefile queryfile outfile\n"
+        << "            (queryfile may be FASTA, FASTQ or 1 sequence per line, optionally gzipped)\n"
+        << "    \"explain\" [-t 0.8] [--batch-size 100000] bloomtreefile queryfile\n"
+        << "    \"replay\" [--threads 16] [--speed 1.0] bloomtreefile replayfile outfile\n"
 
         << "    \"convert\" jfbloomfilter outfile\n"
         << "    \"sim\" [--sim-type 0] bloombase bvfile1 bvfile2\n"
+        << "    \"synth\" [--fill 0.05] [--unique 0.2] [--queries 1000] [--threads 16] hashfile bf_size nb_leaves outdir\n"
         << std::endl;
     exit(3);
 }
@@ -93,6 +174,8 @@ int process_options(int argc, char* argv[]) {
                 break;
             case 'p':
         		num_threads = unsigned(atoi(optarg));
+                QUERY_THREADS = num_threads;
+                BUILD_THREADS = num_threads;
                 //parallel_level = unsigned(atoi(optarg));
                 break;
             case 'f':
@@ -108,11 +191,86 @@ int process_options(int argc, char* argv[]) {
 	        	sim_type = atoi(optarg);
         		break;
     	    case 'c':
-    	    	cutoff_count = unsigned(atoi(optarg));
+    	    	cutoff_count = std::string(optarg) == "auto" ? CUTOFF_AUTO : unsigned(atoi(optarg));
 		        break;
 	        case 'w':
 		        weighted = optarg;
         		break;	
+            case 'b':
+                QUERY_WINDOW = std::size_t(atol(optarg));
+                DIE_IF(QUERY_WINDOW == 0, "--batch-size must be > 0");
+                break;
+            case 'K':
+                top_k = unsigned(atoi(optarg));
+                break;
+            case 'P':
+                use_planner = atoi(optarg);
+                break;
+            case 'T':
+                trace_file = optarg;
+                TRACE_ENABLED = true;
+                break;
+            case 'F':
+                synth_fill = atof(optarg);
+                break;
+            case 'U':
+                synth_unique = atof(optarg);
+                break;
+            case 'Q':
+                synth_queries = unsigned(atoi(optarg));
+                break;
+            case 'R':
+                record_file = optarg;
+                break;
+            case 'S':
+                replay_speed = atof(optarg);
+                break;
+            case 'C':
+                perf_counters = 1;
+                break;
+            case 'M':
+                SKETCH_ENABLED = true;
+                break;
+            case 'A':
+                cluster_leaves = 1;
+                break;
+            case 'B':
+                balanced_tree = 1;
+                break;
+            case 'O':
+                compress_out = optarg;
+                break;
+            case 'D':
+                split_depth = atoi(optarg);
+                break;
+            case 'E':
+                checkpoint_every = unsigned(atoi(optarg));
+                break;
+            case 'Y':
+                resume_build = 1;
+                break;
+            case 'I':
+                WRITE_BEHIND_INTERVAL = atof(optarg);
+                break;
+            case 'G':
+                COMPRESS_MEMORY = uint64_t(atof(optarg) * (1 << 20));
+                break;
+            case 'L':
+                sample_list = optarg;
+                break;
+            case 'X':
+                stream_counts = 1;
+                break;
+            case 'e':
+                FP_RATE = atof(optarg);
+                DIE_IF(FP_RATE <= 0 || FP_RATE >= 1, "--fp-rate must be in (0, 1)");
+                break;
+            case 'Z':
+                auto_size = 1;
+                break;
+            case 'J':
+                from_jf = 1;
+                break;
             default:
                 std::cerr << "Unknown option." << std::endl;
                 print_usage();
@@ -132,6 +290,17 @@ int process_options(int argc, char* argv[]) {
         out_file = argv[optind+3];
         //leaf_only = argv[optind+4];
 
+    } else if (command == "replay") {
+        if (optind >= argc-3) print_usage();
+        bloom_tree_file = argv[optind+1];
+        query_file = argv[optind+2];
+        out_file = argv[optind+3];
+
+    } else if (command == "explain") {
+        if (optind >= argc-2) print_usage();
+        bloom_tree_file = argv[optind+1];
+        query_file = argv[optind+2];
+
     } else if (command == "check") {
         if (optind >= argc-1) print_usage();
         bloom_tree_file = argv[optind+1];
@@ -161,11 +330,42 @@ int process_options(int argc, char* argv[]) {
         //bloom_storage = argv[optind+4];
         // sim_type = argv[optind+4];
 
+    } else if (command == "insert") {
+        if (optind >= argc-2) print_usage();
+        bloom_tree_file = argv[optind+1];
+        query_file = argv[optind+2];
+
+    } else if (command == "remove") {
+        if (optind >= argc-2) print_usage();
+        bloom_tree_file = argv[optind+1];
+        leaf_name = argv[optind+2];
+
+    } else if (command == "optimize") {
+        if (optind >= argc-2) print_usage();
+        bloom_tree_file = argv[optind+1];
+        out_file = argv[optind+2];
+
+    } else if (command == "merge") {
+        if (optind >= argc-3) print_usage();
+        bloom_tree_file = argv[optind+1];
+        bloom_tree_file2 = argv[optind+2];
+        out_file = argv[optind+3];
+
     } else if (command == "hashes") {
         if (optind >= argc-2) print_usage();
         hashes_file = argv[optind+1];
         nb_hashes = atoi(argv[optind+2]);
 
+    } else if (command == "estimate") {
+        if (optind >= argc-2) print_usage();
+        hashes_file = argv[optind+1];
+        query_file = argv[optind+2];
+
+    } else if (command == "count" && !sample_list.empty()) {
+        if (optind >= argc-2) print_usage();
+        hashes_file = argv[optind+1];
+        bf_size = atof(argv[optind+2]);
+
     } else if (command == "count") {
         if (optind >= argc-4) print_usage();
         hashes_file = argv[optind+1];
@@ -174,6 +374,13 @@ int process_options(int argc, char* argv[]) {
         out_file = argv[optind+4];
 
 
+    } else if (command == "synth") {
+        if (optind >= argc-4) print_usage();
+        hashes_file = argv[optind+1];
+        bf_size = atof(argv[optind+2]);
+        nb_leaves = unsigned(atoi(argv[optind+3]));
+        out_file = argv[optind+4];
+
     } else if (command == "compress") {
         if (optind >= argc-2) print_usage();
         bloom_tree_file = argv[optind+1];
@@ -188,6 +395,9 @@ int main(int argc, char* argv[]) {
     std::cerr << "Starting Bloom Tree" << std::endl;
 
     process_options(argc, argv);
+    if (perf_counters) {
+        perf_init();
+    }
 
     if (command == "query") {
         std::cerr << "Loading bloom tree topology: " << bloom_tree_file 
@@ -198,14 +408,35 @@ int main(int argc, char* argv[]) {
 
         std::cerr << "Querying..." << std::endl;
         std::ofstream out(out_file);
-	if (leaf_only == 1){
+	if (record_file != "") {
+		start_recording(record_file);
+	}
+	if (top_k > 0) {
+		std::cerr << "Top-" << top_k << " query \n";
+		topk_query_from_file(root, query_file, top_k, out);
+	} else if (leaf_only == 1){
 		leaf_query_from_file(root, query_file, out);
+	} else if (use_planner == 1) {
+		planned_query_from_file(root, bloom_tree_file, query_file, out);
 	} else if (weighted!="") {
 		std::cerr << "Weighted query \n";
 		batch_weightedquery_from_file(root, query_file, weighted, out);	
 	} else {
 	        batch_query_from_file(root, query_file, out);
 	}
+	stop_recording();
+	if (trace_file != "") {
+		write_trace(trace_file);
+	}
+
+    } else if (command == "replay") {
+        BloomTree* root = read_bloom_tree(bloom_tree_file);
+        std::ofstream out(out_file);
+        replay(root, bloom_tree_file, query_file, num_threads, replay_speed, out);
+
+    } else if (command == "explain") {
+        BloomTree* root = read_bloom_tree(bloom_tree_file);
+        explain_query_from_file(root, bloom_tree_file, query_file, std::cout);
 
     } else if (command == "draw") {
         std::cerr << "Drawing tree in " << bloom_tree_file << " to " << out_file << std::endl;
@@ -252,17 +483,106 @@ int main(int argc, char* argv[]) {
     } else if (command == "hashes") {
         // construct a new hashpair
         construct_hashes(hashes_file, nb_hashes);
+    } else if (command == "estimate") {
+        int nh;
+        HashPair* hp = get_hash_function(hashes_file, nh);
+        std::vector<std::string> inputs;
+        for (const auto & sample : read_sample_list(query_file)) {
+            inputs.push_back(sample.first);
+        }
+        KmerEstimate est = estimate_kmers(inputs, *hp, sizing_cutoff(), num_threads);
+        int best_nh = optimal_nb_hashes(FP_RATE);
+        std::cout << "distinct_kmers\t" << est.distinct << "\n"
+            << "below_cutoff\t" << est.distinct - est.solid << "\n"
+            << "above_cutoff\t" << est.solid << "\n"
+            << "fp_rate\t" << FP_RATE << "\n"
+            << "nb_hashes\t" << best_nh << "\n"
+            << "bf_size\t" << filter_size_for(est.solid, best_nh, FP_RATE) << "\n"
+            << "bf_size_for_hashfile\t" << filter_size_for(est.solid, nh, FP_RATE)
+            << "\t(" << nh << " hashes)" << std::endl;
+        delete hp;
+
     } else if (command == "count") {
         int nh;
         HashPair* hp = get_hash_function(hashes_file, nh);
-	std::cerr << "Cutoff Count: " << cutoff_count << std::endl;
-        count(query_file, out_file, *hp, nh, bf_size, num_threads, cutoff_count);
+        if (cutoff_count == CUTOFF_AUTO) {
+            std::cerr << "Cutoff Count: auto" << std::endl;
+        } else {
+            std::cerr << "Cutoff Count: " << cutoff_count << std::endl;
+        }
+        DIE_IF(stream_counts && cutoff_count == CUTOFF_AUTO, "--cutoff auto needs exact counts; it can't be used with --stream");
+        DIE_IF(from_jf && stream_counts, "--from-jf and --stream can't be used together");
+        DIE_IF(from_jf && auto_size, "--auto-size needs sequence files, not jellyfish databases");
+        CountMode mode = from_jf ? COUNT_FROM_JF : stream_counts ? COUNT_STREAM : COUNT_HASH;
+        DIE_IF(auto_size && sample_list.empty(),
+            "--auto-size needs --batch: filters sized one sample at a time can't share a tree. "
+            "Run \"bt estimate\" over all the samples and pass its bf_size instead.");
+        if (auto_size) {
+            // one size for every sample in the batch, so their filters can
+            // share a tree
+            std::vector<std::string> inputs;
+            for (const auto & sample : read_sample_list(sample_list)) {
+                inputs.push_back(sample.first);
+            }
+            KmerEstimate est = estimate_kmers(inputs, *hp, sizing_cutoff(), num_threads);
+            uint64_t fit = filter_size_for(est.solid, nh, FP_RATE);
+            std::cerr << "Estimated " << est.solid << " kmers at or above the cutoff; "
+                << "filter size " << fit << " for fp rate " << FP_RATE << std::endl;
+            if (fit > bf_size) {
+                WARN("Capping the filter size at " + std::to_string(bf_size));
+            }
+            bf_size = std::min(bf_size, fit);
+        }
+        if (!sample_list.empty()) {
+            count_batch(sample_list, *hp, nh, bf_size, num_threads, cutoff_count, mode);
+        } else if (mode == COUNT_FROM_JF) {
+            count_from_jf(query_file, out_file, *hp, nh, bf_size, num_threads, cutoff_count);
+        } else if (mode == COUNT_STREAM) {
+            stream_count(query_file, out_file, *hp, nh, bf_size, num_threads, cutoff_count);
+        } else {
+            count(query_file, out_file, *hp, nh, bf_size, num_threads, cutoff_count);
+        }
 
     } else if (command == "build") {
         std::cerr << "Building..." << std::endl;
         std::vector<std::string> leaves = read_filter_list(query_file); //not a query file
-        //build_bt_from_jfbloom(leaves, out_file, parallel_level);
-        dynamic_build(hashes_file, leaves, out_file, sim_type); //std::stoi(sim_type));
+        if (balanced_tree) {
+            balanced_build(hashes_file, leaves, out_file, compress_out);
+        } else if (cluster_leaves) {
+            cluster_build(hashes_file, leaves, out_file, sim_type);
+        } else {
+            dynamic_build(hashes_file, leaves, out_file, sim_type, //std::stoi(sim_type));
+                checkpoint_every, resume_build);
+        }
+
+        // the balanced build compresses as it goes; the others compress
+        // the finished tree while its filters are still in the page cache
+        if (!balanced_tree && !compress_out.empty()) {
+            BloomTree* root = read_bloom_tree(out_file, false);
+            compress_bt(root, num_threads);
+            write_compressed_bloom_tree(compress_out, root, hashes_file);
+        }
+
+    } else if (command == "insert") {
+        std::vector<std::string> leaves = read_filter_list(query_file);
+        insert_leaves(bloom_tree_file, leaves, sim_type);
+
+    } else if (command == "remove") {
+        std::cerr << "Removing " << leaf_name << std::endl;
+        remove_leaf(bloom_tree_file, leaf_name);
+
+    } else if (command == "optimize") {
+        std::cerr << "Optimizing " << bloom_tree_file << std::endl;
+        optimize_tree(bloom_tree_file, out_file);
+
+    } else if (command == "merge") {
+        std::cerr << "Merging " << bloom_tree_file << " and " << bloom_tree_file2 << std::endl;
+        merge_trees(bloom_tree_file, bloom_tree_file2, out_file, split_depth, sim_type);
+
+    } else if (command == "synth") {
+        std::cerr << "Synthesizing collection in " << out_file << std::endl;
+        synth_collection(hashes_file, bf_size, nb_leaves, out_file,
+            synth_fill, synth_unique, synth_queries, num_threads);
 
     } else if (command == "compress") {
         std::cerr << "Compressing.." << std::endl;
@@ -273,9 +593,12 @@ int main(int argc, char* argv[]) {
         std::vector<std::string> fields;
         SplitString(header, ',', fields);
             
-        compress_bt(root);
+        compress_bt(root, num_threads);
         write_compressed_bloom_tree(out_file, root, fields[1]);
     }
+    if (PERF_ENABLED) {
+        perf_report(std::cerr);
+    }
     std::cerr << "Done." << std::endl;
 }
 
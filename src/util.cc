@@ -2,6 +2,9 @@
 #include <sstream>
 #include <fenv.h>
 #include <signal.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
 
 std::string quote(std::string in) {
     // TODO: handle quotes embedded in input string
@@ -9,6 +12,46 @@ std::string quote(std::string in) {
 }
 
 
+uint64_t available_memory() {
+    long pages = sysconf(_SC_AVPHYS_PAGES);
+    long page_size = sysconf(_SC_PAGESIZE);
+    if (pages <= 0 || page_size <= 0) return 0;
+    return uint64_t(pages) * uint64_t(page_size);
+}
+
+
+uint64_t file_size(const std::string & fn) {
+    struct stat buf;
+    if (stat(fn.c_str(), &buf) == -1) return 0;
+    return buf.st_size;
+}
+
+
+time_t file_mtime(const std::string & fn) {
+    struct stat buf;
+    if (stat(fn.c_str(), &buf) == -1) return 0;
+    return buf.st_mtime;
+}
+
+
+bool file_newer(const std::string & a, const std::string & b) {
+    struct stat sa, sb;
+    if (stat(a.c_str(), &sa) == -1) return false;
+    if (stat(b.c_str(), &sb) == -1) return true;
+    if (sa.st_mtim.tv_sec != sb.st_mtim.tv_sec) return sa.st_mtim.tv_sec > sb.st_mtim.tv_sec;
+    return sa.st_mtim.tv_nsec > sb.st_mtim.tv_nsec;
+}
+
+
+void readahead_file(const std::string & fn) {
+    int fd = open(fn.c_str(), O_RDONLY);
+    if (fd == -1) return;
+    posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+    posix_fadvise(fd, 0, 0, POSIX_FADV_WILLNEED);
+    close(fd);
+}
+
+
 // removes the directory name and optionally the given suffix.
 std::string test_basename(const std::string & str, const std::string & suff) {
     auto p = str.rfind("/");
@@ -7,6 +7,8 @@
 #include <set>
 #include <vector>
 #include <cassert>
+#include <cstdint>
+#include <ctime>
 
 
 //
@@ -37,6 +39,33 @@ std::string test_basename(const std::string & str, const std::string & suff);
 std::string nosuffix(const std::string & str, const std::string & suff);
 std::string quote(std::string in);
 
+// physical memory not currently in use, in bytes, or 0 if unknown
+uint64_t available_memory();
+
+// size in bytes of the file, or 0 if it can't be stat'ed
+uint64_t file_size(const std::string & fn);
+
+// modification time of the file, or 0 if it can't be stat'ed
+time_t file_mtime(const std::string & fn);
+
+// true if a exists and was modified strictly after b (to the nanosecond), or
+// b doesn't exist
+bool file_newer(const std::string & a, const std::string & b);
+
+// ask the kernel to start reading a file we will need soon
+void readahead_file(const std::string & fn);
+
+// a bijective 64-bit mix (the splitmix64 finalizer): distinct inputs always
+// have distinct, well-spread outputs
+inline uint64_t mix64(uint64_t x) {
+    x ^= x >> 30;
+    x *= 0xbf58476d1ce4e5b9ULL;
+    x ^= x >> 27;
+    x *= 0x94d049bb133111ebULL;
+    x ^= x >> 31;
+    return x;
+}
+
 //==========================================================
 // Error messages
 //==========================================================